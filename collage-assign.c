@@ -0,0 +1,433 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <float.h>
+
+#include "collage.h"
+
+/*
+ * Global assignment of photos to cells as an auction (Bertsekas) with
+ * similar objects: every photo has max_uses slots with a price each. Cells
+ * bid for the cheapest slot of their best candidate, bids of one round are
+ * computed in parallel (Jacobi auction) and resolved per photo. Every cell
+ * can also take a private "no photo" object with a high cost, which keeps
+ * the problem feasible if the candidates are exhausted.
+ *
+ * On a grid the auction does not see the no repetition radius. Its result
+ * is kept in scan order where no kept neighbour within the radius has the
+ * same photo. The remaining cells are auctioned again with the photos of
+ * their kept neighbours removed from their candidates and the slots that
+ * are left.
+ */
+
+static const int AUCTION_MAX_ROUNDS = 100000;
+static const float AUCTION_EPSILON_FACTOR = 4.0f;
+static const float AUCTION_EPSILON_MIN_DIVISOR = 256.0f; // relative to the largest candidate distance
+static const float AUCTION_NO_PHOTO_FACTOR = 2.0f;        // relative to the largest candidate distance
+static const int AUCTION_CONFLICT_ROUNDS = 8;              // auctions of the cells with radius conflicts
+static const int AUCTION_BLOCKED = -3;                     // owner of the slots beyond the capacity of a photo
+
+typedef struct
+{
+    candidate_list_t *candidates;
+    int max_uses;
+    const int *capacity; // slots per photo (<= max_uses), NULL = max_uses
+    float epsilon, no_photo_cost;
+
+    float *slot_price; // image_count * max_uses
+    int *slot_owner;   // cell, -1 or AUCTION_BLOCKED
+    int *assignment;   // slot of every cell, -1 unassigned, -2 no photo
+
+    int *bidders; // unassigned cells of the round
+    int *next_bidders;
+    int bidder_count;
+    int *bid_slot; // per bidder, -1 takes no photo
+    float *bid_value;
+
+    int *photo_bid_begin; // bids sorted by photo (counting sort)
+    int *photo_bids;
+    int *evicted; // per bidder the cell that lost the slot, -1 if none
+    bool *release; // per cell, rebid in the next phase
+} auction_t;
+
+static inline int cheapest_slot(auction_t *auction, int image)
+{
+    float *prices = auction->slot_price + (size_t)image * auction->max_uses;
+    int best = 0;
+    for (int s = 1; s < auction->max_uses; s++)
+    {
+        if (prices[s] < prices[best])
+            best = s;
+    }
+    return image * auction->max_uses + best;
+}
+
+static void compute_bid(int b, void *arg)
+{
+    auction_t *auction = arg;
+    candidate_list_t *candidates = auction->candidates;
+    int cell = auction->bidders[b];
+    int *ids = candidates->ids + (size_t)cell * candidates->k;
+    float *distances = candidates->distances + (size_t)cell * candidates->k;
+
+    // values are -(cost + price), the no photo object has no price
+    float best_value = -auction->no_photo_cost, second_value = -FLT_MAX;
+    int best_slot = -1;
+
+    for (int c = 0; c < candidates->found[cell]; c++)
+    {
+        int slot = cheapest_slot(auction, ids[c]);
+        float value = -(distances[c] + auction->slot_price[slot]);
+        if (value > best_value)
+        {
+            second_value = best_value;
+            best_value = value;
+            best_slot = slot;
+        }
+        else if (value > second_value)
+        {
+            second_value = value;
+        }
+    }
+
+    auction->bid_slot[b] = best_slot;
+    if (best_slot >= 0)
+        auction->bid_value[b] = auction->slot_price[best_slot] + (best_value - second_value) + auction->epsilon;
+}
+
+static int compare_bids_desc(const void *a, const void *b, void *arg)
+{
+    float *bid_value = arg;
+    float va = bid_value[*(const int *)a], vb = bid_value[*(const int *)b];
+    return (va < vb) - (va > vb);
+}
+
+// highest bids of a photo win its cheapest slots
+static void resolve_photo(int image, void *arg)
+{
+    auction_t *auction = arg;
+    int begin = auction->photo_bid_begin[image], end = auction->photo_bid_begin[image + 1];
+    if (begin == end)
+        return;
+
+    qsort_r(auction->photo_bids + begin, end - begin, sizeof(int), compare_bids_desc, auction->bid_value);
+
+    for (int i = begin; i < end; i++)
+    {
+        int b = auction->photo_bids[i];
+        int slot = cheapest_slot(auction, image);
+        if (auction->bid_value[b] <= auction->slot_price[slot])
+            break;
+
+        auction->evicted[b] = auction->slot_owner[slot];
+        if (auction->slot_owner[slot] >= 0)
+            auction->assignment[auction->slot_owner[slot]] = -1;
+        auction->slot_owner[slot] = auction->bidders[b];
+        auction->slot_price[slot] = auction->bid_value[b];
+        auction->assignment[auction->bidders[b]] = slot;
+    }
+}
+
+/*
+ * Marks cells that violate epsilon complementary slackness for the current
+ * epsilon: their photo is worse than the best candidate by more than epsilon.
+ */
+static void check_cell(int cell, void *arg)
+{
+    auction_t *auction = arg;
+    candidate_list_t *candidates = auction->candidates;
+    int *ids = candidates->ids + (size_t)cell * candidates->k;
+    float *distances = candidates->distances + (size_t)cell * candidates->k;
+    int slot = auction->assignment[cell];
+
+    float value = -auction->no_photo_cost, best_value = -auction->no_photo_cost;
+    for (int c = 0; c < candidates->found[cell]; c++)
+    {
+        float candidate_value = -(distances[c] + auction->slot_price[cheapest_slot(auction, ids[c])]);
+        if (candidate_value > best_value)
+            best_value = candidate_value;
+        if (slot >= 0 && ids[c] == slot / auction->max_uses)
+            value = -(distances[c] + auction->slot_price[slot]);
+    }
+
+    auction->release[cell] = value < best_value - auction->epsilon;
+}
+
+// tasks on pool, serially without one
+static void run_tasks(thread_pool_t *pool, int count, thread_task_t task, void *arg)
+{
+    if (pool != NULL)
+        thread_pool_run(pool, count, task, arg);
+    else
+        for (int t = 0; t < count; t++)
+            task(t, arg);
+}
+
+/*
+ * Runs bidding rounds until every cell has a photo or no photo. The first
+ * phase starts with all cells, later ones only with the cells whose
+ * assignment is not good enough for the smaller epsilon.
+ */
+static void run_auction_phase(auction_t *auction, int image_count, bool first, thread_pool_t *pool)
+{
+    candidate_list_t *candidates = auction->candidates;
+    int slots = image_count * auction->max_uses;
+
+    auction->bidder_count = 0;
+    if (first)
+    {
+        for (int s = 0; s < slots; s++)
+        {
+            bool blocked = auction->capacity != NULL && s % auction->max_uses >= auction->capacity[s / auction->max_uses];
+            auction->slot_owner[s] = blocked ? AUCTION_BLOCKED : -1;
+            auction->slot_price[s] = blocked ? INFINITY : 0;
+        }
+        for (int c = 0; c < candidates->count; c++)
+        {
+            auction->assignment[c] = -1;
+            auction->bidders[auction->bidder_count++] = c;
+        }
+    }
+    else
+    {
+        run_tasks(pool, candidates->count, check_cell, auction);
+        for (int c = 0; c < candidates->count; c++)
+        {
+            if (!auction->release[c])
+                continue;
+            if (auction->assignment[c] >= 0)
+                auction->slot_owner[auction->assignment[c]] = -1;
+            auction->assignment[c] = -1;
+            auction->bidders[auction->bidder_count++] = c;
+        }
+
+        // free slots go back to the minimal price
+        for (int s = 0; s < slots; s++)
+        {
+            if (auction->slot_owner[s] == -1)
+                auction->slot_price[s] = 0;
+        }
+    }
+
+    for (int round = 0; round < AUCTION_MAX_ROUNDS && auction->bidder_count > 0; round++)
+    {
+        run_tasks(pool, auction->bidder_count, compute_bid, auction);
+
+        // group the bids by photo
+        memset(auction->photo_bid_begin, 0, (image_count + 1) * sizeof(int));
+        for (int b = 0; b < auction->bidder_count; b++)
+        {
+            auction->evicted[b] = -1;
+            int slot = auction->bid_slot[b];
+            if (slot >= 0)
+                auction->photo_bid_begin[slot / auction->max_uses + 1]++;
+            else
+                auction->assignment[auction->bidders[b]] = -2;
+        }
+        for (int k = 0; k < image_count; k++)
+            auction->photo_bid_begin[k + 1] += auction->photo_bid_begin[k];
+        for (int b = 0; b < auction->bidder_count; b++)
+        {
+            int slot = auction->bid_slot[b];
+            if (slot >= 0)
+                auction->photo_bids[auction->photo_bid_begin[slot / auction->max_uses]++] = b;
+        }
+        for (int k = image_count; k > 0; k--)
+            auction->photo_bid_begin[k] = auction->photo_bid_begin[k - 1];
+        auction->photo_bid_begin[0] = 0;
+
+        run_tasks(pool, image_count, resolve_photo, auction);
+
+        // losers and evicted cells bid again
+        int next_count = 0;
+        for (int b = 0; b < auction->bidder_count; b++)
+        {
+            int cell = auction->bidders[b], evicted = auction->evicted[b];
+            if (auction->assignment[cell] == -1)
+                auction->next_bidders[next_count++] = cell;
+            if (evicted >= 0 && auction->assignment[evicted] == -1)
+                auction->next_bidders[next_count++] = evicted;
+        }
+
+        int *bidders = auction->bidders;
+        auction->bidders = auction->next_bidders;
+        auction->next_bidders = bidders;
+        auction->bidder_count = next_count;
+    }
+}
+
+/*
+ * Assigns every cell of candidates one of its candidate photos, each photo
+ * at most capacity (or max_uses) times, minimising the total distance.
+ * Cells that get no photo are -1 in the returned array.
+ */
+static int *run_auction(candidate_list_t *candidates, int image_count, int max_uses, const int *capacity,
+                        thread_pool_t *pool)
+{
+    auction_t auction = {candidates, max_uses > 0 ? max_uses : 1, capacity};
+    int cells = candidates->count;
+
+    float max_distance = 0;
+    for (int c = 0; c < cells; c++)
+    {
+        for (int i = 0; i < candidates->found[c]; i++)
+        {
+            if (candidates->distances[(size_t)c * candidates->k + i] > max_distance)
+                max_distance = candidates->distances[(size_t)c * candidates->k + i];
+        }
+    }
+    if (max_distance <= 0)
+        max_distance = 1;
+    auction.no_photo_cost = AUCTION_NO_PHOTO_FACTOR * max_distance;
+
+    size_t slots = (size_t)image_count * auction.max_uses;
+    auction.slot_price = malloc(slots * sizeof(float));
+    auction.slot_owner = malloc(slots * sizeof(int));
+    auction.assignment = malloc(cells * sizeof(int));
+    auction.bidders = malloc(cells * sizeof(int));
+    auction.next_bidders = malloc(cells * sizeof(int));
+    auction.bid_slot = malloc(cells * sizeof(int));
+    auction.bid_value = malloc(cells * sizeof(float));
+    auction.photo_bid_begin = malloc((image_count + 1) * sizeof(int));
+    auction.photo_bids = malloc(cells * sizeof(int));
+    auction.evicted = malloc(cells * sizeof(int));
+    auction.release = malloc(cells * sizeof(bool));
+
+    // epsilon scaling: coarse phases settle the prices fast
+    float epsilon_min = max_distance / AUCTION_EPSILON_MIN_DIVISOR;
+    bool first = true;
+    for (auction.epsilon = max_distance / AUCTION_EPSILON_FACTOR;; auction.epsilon /= AUCTION_EPSILON_FACTOR)
+    {
+        if (auction.epsilon < epsilon_min)
+            auction.epsilon = epsilon_min;
+        run_auction_phase(&auction, image_count, first, pool);
+        first = false;
+        if (auction.epsilon <= epsilon_min)
+            break;
+    }
+
+    int *assignment = malloc(cells * sizeof(int));
+    for (int c = 0; c < cells; c++)
+        assignment[c] = auction.assignment[c] >= 0 ? auction.assignment[c] / auction.max_uses : -1;
+
+    free(auction.slot_price);
+    free(auction.slot_owner);
+    free(auction.assignment);
+    free(auction.bidders);
+    free(auction.next_bidders);
+    free(auction.bid_slot);
+    free(auction.bid_value);
+    free(auction.photo_bid_begin);
+    free(auction.photo_bids);
+    free(auction.evicted);
+    free(auction.release);
+    return assignment;
+}
+
+// marks the photos of the kept cells within radius of cell with stamp
+static void stamp_neighbours(const int *kept, int rows, int cols, int radius, int cell, int *stamps, int stamp)
+{
+    int i = cell / cols, j = cell % cols;
+    for (int k = i - radius > 0 ? i - radius : 0; k <= i + radius && k < rows; k++)
+    {
+        for (int l = j - radius > 0 ? j - radius : 0; l <= j + radius && l < cols; l++)
+        {
+            if (kept[k * cols + l] >= 0)
+                stamps[kept[k * cols + l]] = stamp;
+        }
+    }
+}
+
+/*
+ * Global assignment for the rows x cols cells of candidates: each photo at
+ * most max_uses times and never twice within radius (in both directions,
+ * like the exclusion window of the later cell). Cells that get no photo
+ * are -1 in the returned array (to be freed by the caller).
+ */
+int *assign_photos_global(candidate_list_t *candidates, int image_count, int max_uses,
+                          int rows, int cols, int radius, thread_pool_t *pool)
+{
+    int cells = candidates->count;
+    max_uses = max_uses > 0 ? max_uses : 1;
+
+    // more uses always conflict within radius, fewer slots also make the bids cheaper
+    int spaced_uses = ((rows + radius) / (radius + 1)) * ((cols + radius) / (radius + 1));
+    if (max_uses > spaced_uses)
+        max_uses = spaced_uses;
+    int *assignment = run_auction(candidates, image_count, max_uses, NULL, pool);
+
+    int *kept = malloc(cells * sizeof(int));
+    int *uses = calloc(image_count, sizeof(int));
+    int *stamps = malloc(image_count * sizeof(int));
+    int *pending = malloc(cells * sizeof(int)); // cells to keep, in scan order
+    int pending_count = 0, stamp = 0;
+    for (int c = 0; c < cells; c++)
+    {
+        kept[c] = -1;
+        if (assignment[c] >= 0)
+            pending[pending_count++] = c;
+    }
+    for (int k = 0; k < image_count; k++)
+        stamps[k] = -1;
+
+    for (int round = 0; pending_count > 0; round++)
+    {
+        int conflict_count = 0;
+        for (int p = 0; p < pending_count; p++)
+        {
+            int cell = pending[p], image = assignment[cell];
+            stamp_neighbours(kept, rows, cols, radius, cell, stamps, ++stamp);
+            if (stamps[image] == stamp || uses[image] >= max_uses)
+            {
+                pending[conflict_count++] = cell;
+                continue;
+            }
+            kept[cell] = image;
+            uses[image]++;
+        }
+        if (conflict_count == 0 || round == AUCTION_CONFLICT_ROUNDS)
+            break;
+
+        // the conflicting cells bid again for the slots left, without the photos of their neighbours
+        candidate_list_t retry = alloc_candidate_list(candidates->k, conflict_count);
+        for (int r = 0; r < conflict_count; r++)
+        {
+            int cell = pending[r];
+            const int *ids = candidates->ids + (size_t)cell * candidates->k;
+            const float *distances = candidates->distances + (size_t)cell * candidates->k;
+            stamp_neighbours(kept, rows, cols, radius, cell, stamps, ++stamp);
+            retry.found[r] = 0;
+            for (int c = 0; c < candidates->found[cell]; c++)
+            {
+                if (stamps[ids[c]] == stamp || uses[ids[c]] >= max_uses)
+                    continue;
+                retry.ids[(size_t)r * retry.k + retry.found[r]] = ids[c];
+                retry.distances[(size_t)r * retry.k + retry.found[r]++] = distances[c];
+            }
+        }
+
+        int *capacity = malloc(image_count * sizeof(int));
+        for (int k = 0; k < image_count; k++)
+            capacity[k] = max_uses - uses[k];
+        int *retry_assignment = run_auction(&retry, image_count, max_uses, capacity, pool);
+
+        pending_count = 0;
+        for (int r = 0; r < conflict_count; r++)
+        {
+            assignment[pending[r]] = retry_assignment[r];
+            if (retry_assignment[r] >= 0)
+                pending[pending_count++] = pending[r];
+        }
+        free(retry_assignment);
+        free(capacity);
+        free_candidate_list(&retry);
+    }
+
+    free(assignment);
+    free(uses);
+    free(stamps);
+    free(pending);
+    return kept;
+}
@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "collage.h"
+
+/*
+ * Cache of top-k candidate lists keyed by the quantized cell descriptor.
+ * Flat areas of the creator image give many cells with the same key, they
+ * share one list instead of searching the library again. The table is
+ * guarded by a mutex, entries are immutable and never move once inserted.
+ */
+
+static const float CACHE_SHAPE_STEP = 1.0f / 16; // luminance
+static const float CACHE_L_STEP = 100.0f / 16;
+static const float CACHE_AB_STEP = 4.0f;
+static const int CACHE_INITIAL_CAPACITY = 1024;
+
+static inline float get_step(descriptor_t type, int d)
+{
+    if (type == DESCRIPTOR_COLOR)
+        return d < 4 ? CACHE_L_STEP : CACHE_AB_STEP;
+    return CACHE_SHAPE_STEP;
+}
+
+static unsigned int hash_key(const int *key, int dim)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (int d = 0; d < dim; d++)
+    {
+        hash ^= (unsigned int)key[d];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void init_match_cache(match_cache_t *cache, descriptor_t type, int k)
+{
+    cache->type = type;
+    cache->dim = get_descriptor_dimension(type);
+    cache->k = k;
+    cache->capacity = CACHE_INITIAL_CAPACITY;
+    cache->count = 0;
+    cache->entries = calloc(cache->capacity, sizeof(match_cache_entry_t *));
+    cache->hits = 0;
+    cache->lookups = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+// key of descriptor and the centre of its quantization cell
+void get_match_cache_key(const match_cache_t *cache, const float *descriptor, int *key, float *centre)
+{
+    for (int d = 0; d < cache->dim; d++)
+    {
+        float step = get_step(cache->type, d);
+        key[d] = (int)floorf(descriptor[d] / step);
+        centre[d] = (key[d] + 0.5f) * step;
+    }
+}
+
+// slot of key in entries, empty if the key is not cached (lock held)
+static int find_slot(match_cache_t *cache, const int *key)
+{
+    int slot = hash_key(key, cache->dim) & (cache->capacity - 1);
+    while (cache->entries[slot] != NULL &&
+           memcmp(cache->entries[slot]->key, key, cache->dim * sizeof(int)) != 0)
+        slot = (slot + 1) & (cache->capacity - 1);
+    return slot;
+}
+
+match_cache_entry_t *match_cache_find(match_cache_t *cache, const int *key)
+{
+    pthread_mutex_lock(&cache->lock);
+    match_cache_entry_t *entry = cache->entries[find_slot(cache, key)];
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+/*
+ * Stores the count candidates of key and returns the cached entry, which
+ * is the one of another thread if it was faster.
+ */
+match_cache_entry_t *match_cache_insert(match_cache_t *cache, const int *key, const float *centre,
+                                        const int *ids, const float *distances, int count)
+{
+    match_cache_entry_t *entry = malloc(sizeof(match_cache_entry_t));
+    memcpy(entry->key, key, cache->dim * sizeof(int));
+    memcpy(entry->centre, centre, cache->dim * sizeof(float));
+    entry->count = count;
+    entry->ids = malloc((count > 0 ? count : 1) * sizeof(int));
+    entry->distances = malloc((count > 0 ? count : 1) * sizeof(float));
+    memcpy(entry->ids, ids, count * sizeof(int));
+    memcpy(entry->distances, distances, count * sizeof(float));
+
+    pthread_mutex_lock(&cache->lock);
+    int slot = find_slot(cache, key);
+    if (cache->entries[slot] != NULL)
+    {
+        match_cache_entry_t *existing = cache->entries[slot];
+        pthread_mutex_unlock(&cache->lock);
+        free(entry->ids);
+        free(entry->distances);
+        free(entry);
+        return existing;
+    }
+
+    cache->entries[slot] = entry;
+    cache->count++;
+
+    // grow at half load
+    if (2 * cache->count > cache->capacity)
+    {
+        match_cache_entry_t **entries = cache->entries;
+        int capacity = cache->capacity;
+        cache->capacity *= 2;
+        cache->entries = calloc(cache->capacity, sizeof(match_cache_entry_t *));
+        for (int s = 0; s < capacity; s++)
+        {
+            if (entries[s] != NULL)
+                cache->entries[find_slot(cache, entries[s]->key)] = entries[s];
+        }
+        free(entries);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+}
+
+void free_match_cache(match_cache_t *cache)
+{
+    for (int s = 0; s < cache->capacity; s++)
+    {
+        if (cache->entries[s] == NULL)
+            continue;
+        free(cache->entries[s]->ids);
+        free(cache->entries[s]->distances);
+        free(cache->entries[s]);
+    }
+    free(cache->entries);
+    cache->entries = NULL;
+    pthread_mutex_destroy(&cache->lock);
+}
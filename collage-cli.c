@@ -1,22 +1,26 @@
 #include <stdio.h>
 #include <dirent.h>
 #include <time.h>
+#include <unistd.h>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "lib/stb_image.h"
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "lib/stb_image_write.h"
-
 #include "collage.h"
 
 /* Configuration */
 
-static const int FOTO_LIMIT = 600; // for multi
+static int FOTO_LIMIT = 600; // for multi, can be set with -n (0 = no limit)
 static const int FILENAME_LENGTH = 100;
 static const int DEFAULT_JPG_QUALITY = 70;
+static char DEBUG_IMAGE_PATH[] = "main-image.ppm"; // written with -d, uncompressed is the fastest
+static char DEBUG_COLLAGE_PATH[] = "collage-inner.ppm"; // multi before the border, written with -d
 static bool VERBOSE_OUTPUT = false; // can be set with -v
 static bool DEBUG_OUTPUT = false;   // can be set with -d
+static bool DCT_ASSEMBLY = false;   // for multi, can be set with --dct
+static FILE *IMAGE_STREAM = NULL;   // stdout of the process with OUTPUT_PATH "-"
+static multi_options_t MULTI_OPTIONS; // for multi, set with -c, -m, -p, -l, -r, -g, -u, -s, -a, --no-cache, --seed, -j
+static single_options_t SINGLE_OPTIONS; // for single, set with -t, --dither, -j
 
 /* Miscellaneous methods */
 
@@ -29,7 +33,7 @@ void print_usage()
 
     printf("\narguments:\n");
     printf("\tINPUT_IMAGE\tpath to image\n");
-    printf("\tOUTPUT_PATH\tath of output-image to write\n");
+    printf("\tOUTPUT_PATH\tpath of output-image to write, jpeg or by extension .png\n\t\t\t(uncompressed), .qoi or .ppm, .dzi a deep zoom pyramid of\n\t\t\tjpeg tiles, \"-\" writes a jpeg to stdout\n");
     printf("\tINPUT_FOLDER\tpath of folder, which images are included in the collage\n");
     printf("\tMODE\t0 = based on INPUT_IMAGE, 1 = circle\n");
     printf("\tCOLLAGE_SIZE\t\"widthxheight\" or \"A1\", \"A2\", \"A3\", \"A4\"\n");
@@ -39,6 +43,22 @@ void print_usage()
     printf("\t-h --help\tshow help/usage\n");
     printf("\t-v --verbose\tenable verbose logs\n");
     printf("\t-d --debug\t(for multi) write images for every stage in process\n");
+    printf("\t-c --color\t(for multi) match photos by CIELAB colour instead of luminance\n");
+    printf("\t-r --radius\t(for multi) cells around a photo without repetition, \"auto\" (default)\n\t\t\tdepends on the amount of photos\n");
+    printf("\t-g --global\t(for multi) assign photos to all cells at once instead of line by line\n");
+    printf("\t-u --max-uses\t(for multi) uses per photo, default: no limit (with -g: cells / photos)\n");
+    printf("\t-s --spread\t(for multi) cost per previous use of a photo in luminance, e.g. 0.05,\n\t\t\tspreads the photos over the collage, default: 0\n");
+    printf("\t-a --anneal\t(for multi) seconds to refine the placement by simulated annealing,\n\t\t\tdefault: 0 (off)\n");
+    printf("\t--no-cache\t(for multi) match every cell on its own, no candidates shared by\n\t\t\tcells that look alike\n");
+    printf("\t--seed\t\t(for multi) seed of the random photos of white contour cells, default: 0\n");
+    printf("\t--dct\t\t(for multi) jpeg copied together from the DCT blocks of the photos,\n\t\t\tfaster, photo size rounded to 16 px (8 px above JPG_QUALITY 90)\n");
+    printf("\t-t --tones\t(for single) tones of the tile rendered once, e.g. 64, faster than\n\t\t\ttoning every cell, default: 0 (exact tones)\n");
+    printf("\t--dither\t(for single, with -t) ordered dithering between the tone levels\n");
+    printf("\t-j --threads\tnumber of threads, default: all cpus\n");
+    printf("\t-m --matcher\t(for multi) \"linear\", \"kd\" (k-d tree, default), \"vp\" (VP-tree),\n\t\t\t\"batch\" (SIMD brute force), \"ivf\" (approximate, for large libraries)\n\t\t\tor \"coarse\" (approximate, shortlist by luminance)\n");
+    printf("\t-p --probes\t(for multi, with -m ivf) photo lists searched per cell, more is\n\t\t\tslower and more exact, default: 8\n");
+    printf("\t-l --shortlist\t(for multi, with -m coarse) photos of similar luminance compared\n\t\t\tper cell, more is slower and more exact, default: 64\n");
+    printf("\t-n --max-photos\t(for multi) photos loaded from IMAGE_FOLDER, 0 = all, default: 600\n");
 }
 
 char **get_all_filenames(char *folder, int *file_count)
@@ -74,10 +94,43 @@ char **get_all_filenames(char *folder, int *file_count)
     return filenames;
 }
 
+/*
+ * With "-" as output_path the image is written to stdout and the logs are
+ * moved to stderr, so the image can be piped into another process.
+ */
+void prepare_output(char *output_path)
+{
+    if (strcmp(output_path, "-") != 0 || IMAGE_STREAM != NULL)
+        return;
+
+    fflush(stdout);
+    IMAGE_STREAM = fdopen(dup(STDOUT_FILENO), "wb");
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+}
+
+output_target_t get_output_target(char *output_path)
+{
+    output_target_t target = {output_path};
+    if (strcmp(output_path, "-") == 0)
+    {
+        target.path = "stdout";
+        target.stream = IMAGE_STREAM;
+    }
+    return target;
+}
+
+// format by the extension of output_path (jpeg for "-"), see create_output_sink
+row_sink_t *create_output(char *output_path, int quality, int threads)
+{
+    return create_output_sink(get_output_target(output_path), get_output_format(output_path), quality, threads);
+}
+
 bool write_image(char *output_path, image_t image, int quality)
 {
-    stbi_write_jpg(output_path, image.w, image.h, image.ch, image.pix, quality);
-    return true;
+    row_sink_t *sink = create_output(output_path, quality, 0);
+    bool success = write_image_to_sink(image, sink);
+    free_row_sink(sink);
+    return success;
 }
 
 /* Implementation */
@@ -154,15 +207,15 @@ void single_collage(char *input_image, char *output_image, int mode)
     if (VERBOSE_OUTPUT)
         print_image_dimensions("squared image", squared_image);
 
-    image_t collage = collage_from_single_image(shrunk_image, squared_image, mode);
+    // encoded while it is rendered, the collage is never in memory as a whole
+    row_sink_t *sink = create_output(output_image, DEFAULT_JPG_QUALITY, SINGLE_OPTIONS.threads);
+    bool success = stream_single_image(shrunk_image, squared_image, mode, SINGLE_OPTIONS, sink);
+    free_row_sink(sink);
 
-    if (collage.pix != NULL)
-    {
-        if (VERBOSE_OUTPUT)
-            print_image_dimensions("collage single", collage);
-        write_image(output_image, collage, DEFAULT_JPG_QUALITY);
-        stbi_image_free(collage.pix);
-    }
+    if (!success)
+        fprintf(stderr, "ERR: collage not created\n");
+    else if (VERBOSE_OUTPUT)
+        printf("collage single with %dx%d px\n", shrunk_image.w * squared_image.w, shrunk_image.h * squared_image.h);
 
     stbi_image_free(shrunk_image.pix);
 }
@@ -170,7 +223,7 @@ void single_collage(char *input_image, char *output_image, int mode)
 void multi_collage(
     char *input_image_path, char *output_image_path, char *image_folder,
     char *collage_size_identifier, int border_size_guidance, int foto_size,
-    int jpg_quality, bool mode_contour)
+    int jpg_quality, multi_options_t options)
 {
     int collage_width, collage_height;
 
@@ -222,6 +275,15 @@ void multi_collage(
     int fotos_per_row = floor((float)collage_width / foto_size);
     int foto_width = floor((float)collage_width / fotos_per_row),
         foto_height = foto_width;
+
+    // the photos are put on the MCU grid of the jpeg to copy their DCT blocks
+    if (DCT_ASSEMBLY && get_output_format(output_image_path) == OUTPUT_JPEG)
+    {
+        int mcu_size = get_jpeg_mcu_size(jpg_quality);
+        foto_width = (foto_width + mcu_size / 2) / mcu_size * mcu_size;
+        foto_width = foto_width > mcu_size ? foto_width : mcu_size;
+        foto_height = foto_width;
+    }
     int fotos_horiz = (int)floor((float)(collage_width - 2 * border_size_guidance) / foto_width),
         fotos_vert = (int)floor((float)(collage_height - 2 * border_size_guidance) / foto_height);
     int collage_inner_width = foto_width * fotos_horiz,
@@ -261,7 +323,7 @@ void multi_collage(
     if (VERBOSE_OUTPUT)
         print_image_dimensions("Main image shrunk", creator_shrunk);
     if (DEBUG_OUTPUT)
-        write_image("main-image.jpg", creator_shrunk, jpg_quality);
+        write_image(DEBUG_IMAGE_PATH, creator_shrunk, jpg_quality);
     stbi_image_free(creator_image.pix);
 
     /*  Load fotos  */
@@ -274,14 +336,17 @@ void multi_collage(
         return;
     }
 
-    foto_count = fmin(foto_count, FOTO_LIMIT);
+    if (FOTO_LIMIT > 0)
+        foto_count = fmin(foto_count, FOTO_LIMIT);
 
     if (VERBOSE_OUTPUT)
         printf("%d fotos found\n", foto_count);
 
-    uint8_t *all_images[foto_count];
-    float images_luminance[foto_count];
-    image_shape_t images_structure[foto_count];
+    // on the heap, large libraries do not fit on the stack
+    uint8_t **all_images = malloc(foto_count * sizeof(uint8_t *));
+    float *images_luminance = malloc(foto_count * sizeof(float));
+    image_shape_t *images_structure = malloc(foto_count * sizeof(image_shape_t));
+    image_color_t *images_color = malloc(foto_count * sizeof(image_color_t));
 
     if (!VERBOSE_OUTPUT)
         printf("load images (%d)", foto_count);
@@ -303,16 +368,18 @@ void multi_collage(
             all_images[i] = NULL;
             images_luminance[i] = 0;
             images_structure[i] = image_shape_default;
+            images_color[i] = image_color_default;
             if (VERBOSE_OUTPUT)
                 printf("WARN: foto %s not suitable with %dx%d\n", filenames[i], image.w, image.h);
             continue;
         }
 
         image_t image_cut = shrink_image_size(image, foto_width, foto_height);
-        float Y = get_average_luminance(image_cut);
+        float Y;
+        image_shape_t S;
+        get_image_descriptors(image_cut, &Y, &S, &images_color[i]);
         all_images[i] = image_cut.pix;
         images_luminance[i] = Y;
-        image_shape_t S = get_image_shape(image_cut);
         images_structure[i] = S;
 
         if (VERBOSE_OUTPUT)
@@ -327,43 +394,75 @@ void multi_collage(
     if (suitable_foto_count == 0)
     {
         fprintf(stderr, "ERR: probably wrong image folder\n");
+        free(all_images);
+        free(images_luminance);
+        free(images_structure);
+        free(images_color);
         free(filenames);
         return;
     }
 
+    /*  Build indexes  */
+
+    tile_library_t library = {
+        all_images, foto_width, foto_height, foto_count,
+        images_luminance, images_structure, images_color};
+    build_tile_indexes(&library, options);
+
     /*  Create collage  */
 
-    image_t collage_inner = collage_from_multiple_images(
-        creator_shrunk, all_images, foto_width, foto_height, foto_count,
-        images_luminance, images_structure, mode_contour);
-    stbi_image_free(creator_shrunk.pix);
-    for (int i = 0; i < foto_count; i++)
-        stbi_image_free(all_images[i]);
-    if (VERBOSE_OUTPUT)
-        printf("Collage created with %dx%d images\n", fotos_horiz, fotos_vert);
+    // the border is streamed with the collage, no second full size copy
+    border_t border = border_none;
+    if (border_size_guidance != 0)
+    {
+        border = (border_t){border_top, border_bottom, border_left, border_right, 255, 255, 255};
+        if (VERBOSE_OUTPUT)
+            printf("add border: %d %d %d %d px\n", border_top, border_right, border_bottom, border_left);
+    }
 
-    if (border_size_guidance == 0)
+    bool success;
+    if (DCT_ASSEMBLY && border_size_guidance == 0 && get_output_format(output_image_path) == OUTPUT_JPEG)
     {
-        write_image(output_image_path, collage_inner, jpg_quality);
+        success = assemble_multiple_images_jpeg(creator_shrunk, &library, options,
+                                                get_output_target(output_image_path), jpg_quality);
     }
     else
     {
-        /*  Add border  */
+        cell_grid_t cells = get_cell_grid(creator_shrunk, options.mode_color);
+        selection_grid_t selection = select_photos(&cells, &library, options);
+        free_cell_grid(&cells);
 
-        if (DEBUG_OUTPUT)
-            write_image(output_image_path, collage_inner, jpg_quality);
-        if (VERBOSE_OUTPUT)
-            printf("add border: %d %d %d %d px\n", border_top, border_right, border_bottom, border_left);
+        // stage image of the collage before the border, rendered a second time
+        if (DEBUG_OUTPUT && border_size_guidance != 0)
+        {
+            row_sink_t *debug_sink = create_file_sink(DEBUG_COLLAGE_PATH, jpg_quality, options.threads);
+            stream_selection(&selection, &library, creator_shrunk.ch, border_none, options.threads, debug_sink);
+            free_row_sink(debug_sink);
+        }
 
-        image_t collage_with_border = add_border(
-            collage_inner, border_top, border_bottom, border_left, border_right,
-            255, 255, 255);
-        write_image(output_image_path, collage_with_border, jpg_quality);
-        stbi_image_free(collage_with_border.pix);
+        row_sink_t *sink = create_output(output_image_path, jpg_quality, options.threads);
+        success = stream_selection(&selection, &library, creator_shrunk.ch, border, options.threads, sink);
+        free_row_sink(sink);
+        free_selection_grid(&selection);
     }
 
-    stbi_image_free(collage_inner.pix);
+    stbi_image_free(creator_shrunk.pix);
+    free_tile_indexes(&library);
+    for (int i = 0; i < foto_count; i++)
+        stbi_image_free(all_images[i]);
+    free(all_images);
+    free(images_luminance);
+    free(images_structure);
+    free(images_color);
     free(filenames);
+
+    if (!success)
+    {
+        fprintf(stderr, "ERR: collage not created\n");
+        return;
+    }
+    if (VERBOSE_OUTPUT)
+        printf("Collage created with %dx%d images\n", fotos_horiz, fotos_vert);
 }
 
 int main(int argc, char *argv[])
@@ -376,8 +475,10 @@ int main(int argc, char *argv[])
 
     clock_t start_time = clock();
     int no_options = 0;
+    MULTI_OPTIONS = multi_options_default;
+    SINGLE_OPTIONS = single_options_default;
 
-    for (int i = 1; i < 4 && i < argc; i++)
+    for (int i = 1; i < argc && argv[i][0] == '-'; i++)
     {
         if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0)
         {
@@ -390,11 +491,125 @@ int main(int argc, char *argv[])
             DEBUG_OUTPUT = true;
             no_options++;
         }
+        else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--color") == 0)
+        {
+            MULTI_OPTIONS.mode_color = true;
+            no_options++;
+        }
+        else if ((strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--radius") == 0) && i + 1 < argc)
+        {
+            char *radius = argv[++i];
+            MULTI_OPTIONS.radius = strcmp(radius, "auto") == 0 ? -1 : atoi(radius);
+            if (MULTI_OPTIONS.radius < -1)
+                MULTI_OPTIONS.radius = -1;
+            no_options += 2;
+        }
+        else if (strcmp(argv[i], "-g") == 0 || strcmp(argv[i], "--global") == 0)
+        {
+            MULTI_OPTIONS.assign_global = true;
+            no_options++;
+        }
+        else if ((strcmp(argv[i], "-u") == 0 || strcmp(argv[i], "--max-uses") == 0) && i + 1 < argc)
+        {
+            MULTI_OPTIONS.max_uses = atoi(argv[++i]);
+            no_options += 2;
+        }
+        else if ((strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--spread") == 0) && i + 1 < argc)
+        {
+            MULTI_OPTIONS.usage_penalty = atof(argv[++i]);
+            no_options += 2;
+        }
+        else if ((strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--anneal") == 0) && i + 1 < argc)
+        {
+            MULTI_OPTIONS.refine_seconds = atof(argv[++i]);
+            no_options += 2;
+        }
+        else if (strcmp(argv[i], "--no-cache") == 0)
+        {
+            MULTI_OPTIONS.match_cache = false;
+            no_options++;
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            MULTI_OPTIONS.seed = (unsigned int)strtoul(argv[++i], NULL, 10);
+            no_options += 2;
+        }
+        else if (strcmp(argv[i], "--dct") == 0)
+        {
+            DCT_ASSEMBLY = true;
+            no_options++;
+        }
+        else if ((strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--tones") == 0) && i + 1 < argc)
+        {
+            SINGLE_OPTIONS.tone_levels = atoi(argv[++i]);
+            no_options += 2;
+        }
+        else if (strcmp(argv[i], "--dither") == 0)
+        {
+            SINGLE_OPTIONS.dither = true;
+            no_options++;
+        }
+        else if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0) && i + 1 < argc)
+        {
+            MULTI_OPTIONS.threads = atoi(argv[++i]);
+            SINGLE_OPTIONS.threads = MULTI_OPTIONS.threads;
+            no_options += 2;
+        }
+        else if ((strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--matcher") == 0) && i + 1 < argc)
+        {
+            char *matcher = argv[++i];
+            if (strcmp(matcher, "linear") == 0)
+                MULTI_OPTIONS.matcher = MATCHER_LINEAR;
+            else if (strcmp(matcher, "kd") == 0)
+                MULTI_OPTIONS.matcher = MATCHER_KD_TREE;
+            else if (strcmp(matcher, "vp") == 0)
+                MULTI_OPTIONS.matcher = MATCHER_VP_TREE;
+            else if (strcmp(matcher, "batch") == 0)
+                MULTI_OPTIONS.matcher = MATCHER_BATCH;
+            else if (strcmp(matcher, "ivf") == 0)
+                MULTI_OPTIONS.matcher = MATCHER_IVF;
+            else if (strcmp(matcher, "coarse") == 0)
+                MULTI_OPTIONS.matcher = MATCHER_COARSE;
+            else
+            {
+                printf("unknown matcher \"%s\"\n\n", matcher);
+                print_usage();
+                return -1;
+            }
+            no_options += 2;
+        }
+        else if ((strcmp(argv[i], "-l") == 0 || strcmp(argv[i], "--shortlist") == 0) && i + 1 < argc)
+        {
+            MULTI_OPTIONS.shortlist = atoi(argv[++i]);
+            no_options += 2;
+        }
+        else if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--probes") == 0) && i + 1 < argc)
+        {
+            MULTI_OPTIONS.probes = atoi(argv[++i]);
+            no_options += 2;
+        }
+        else if ((strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--max-photos") == 0) && i + 1 < argc)
+        {
+            FOTO_LIMIT = atoi(argv[++i]);
+            no_options += 2;
+        }
         else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
         {
             print_usage();
             return 0;
         }
+        else
+        {
+            printf("unknown option \"%s\"\n\n", argv[i]);
+            print_usage();
+            return -1;
+        }
+    }
+
+    if (argc < 4 + no_options)
+    {
+        print_usage();
+        return -1;
     }
 
     char action[20];
@@ -404,19 +619,19 @@ int main(int argc, char *argv[])
     strcpy(action, argv[1 + no_options]);
     strcpy(input_image, argv[2 + no_options]);
 
-    if (strcmp(action, "multi") == 0 && argc >= 7)
+    if (strcmp(action, "multi") == 0 && argc >= 7 + no_options)
     {
         char image_folder[FILENAME_LENGTH], collage_size_id[20], jpg_quality_str[5];
         int jpg_quality;
         strcpy(image_folder, argv[3 + no_options]);
         strcpy(output_image, argv[4 + no_options]);
+        prepare_output(output_image);
         strcpy(collage_size_id, argv[5 + no_options]);
         strcpy(jpg_quality_str, argv[6 + no_options]);
         jpg_quality = atoi(jpg_quality_str);
 
-        bool mode_contour = true;
         if (argc > 7 + no_options && strcmp(argv[7 + no_options], "false") == 0)
-            mode_contour = false;
+            MULTI_OPTIONS.mode_contour = false;
 
         // TODO: calculate size according to collage dimensions
         int foto_size = 118; // default = 118 (good for print 300dpi)
@@ -424,11 +639,12 @@ int main(int argc, char *argv[])
         multi_collage(
             input_image, output_image, image_folder,
             collage_size_id, 0, foto_size,
-            jpg_quality, mode_contour);
+            jpg_quality, MULTI_OPTIONS);
     }
     else if (strcmp(action, "shrink") == 0)
     {
         strcpy(output_image, argv[3 + no_options]);
+        prepare_output(output_image);
         shrink_collage(input_image, output_image);
     }
     else if (strcmp(action, "single") == 0)
@@ -436,6 +652,7 @@ int main(int argc, char *argv[])
         char mode_str[4];
         int mode;
         strcpy(output_image, argv[3 + no_options]);
+        prepare_output(output_image);
         strcpy(mode_str, argv[4 + no_options]);
         mode = atoi(mode_str);
         single_collage(input_image, output_image, mode);
@@ -0,0 +1,322 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "collage.h"
+
+/*
+ * Deep Zoom (DZI) pyramid as a row sink: NAME.dzi describes the image, the
+ * tiles of level L are NAME_files/L/COL_ROW.jpg. Every level collects the
+ * rows of one row of tiles and writes its tiles in parallel as soon as the
+ * last row arrived, pairs of rows are averaged 2x2 into the next smaller
+ * level on the way. The full resolution image is never in memory or on disk.
+ */
+
+static const int DZI_TILE_SIZE = 254;
+static const int DZI_OVERLAP = 1; // pixels shared with the neighbouring tiles
+
+typedef struct
+{
+    int w, h;
+    uint8_t *rows;            // rows of the row of tiles in progress
+    int first_row, row_count; // image row of rows, rows held
+    int tile_row;             // next row of tiles to write
+    uint8_t *pending;         // row waiting for its pair, for the next level
+    bool has_pending;
+    uint8_t *halved; // averaged row for the next level
+} dzi_level_t;
+
+typedef struct
+{
+    output_target_t target;
+    int quality;
+    int threads;
+    thread_pool_t *pool;
+    char *base; // path without .dzi
+    int ch;
+    int level_count; // level_count - 1 is the full resolution
+    dzi_level_t *levels;
+    int rows_written;
+    bool failed;
+} dzi_sink_t;
+
+typedef struct
+{
+    dzi_sink_t *dzi;
+    int level, top, bottom;
+} tile_row_job_t;
+
+static bool make_directory(const char *path)
+{
+    if (mkdir(path, 0755) == 0 || errno == EEXIST)
+        return true;
+    fprintf(stderr, "ERR: could not create directory %s\n", path);
+    return false;
+}
+
+// tile c of the current row of tiles of a level, with overlap
+static void write_dzi_tile(int c, void *arg)
+{
+    tile_row_job_t *job = arg;
+    dzi_sink_t *dzi = job->dzi;
+    dzi_level_t *level = &dzi->levels[job->level];
+    int left = c * DZI_TILE_SIZE - DZI_OVERLAP, right = (c + 1) * DZI_TILE_SIZE + DZI_OVERLAP;
+    left = left > 0 ? left : 0;
+    right = right < level->w ? right : level->w;
+
+    image_t tile = {NULL, right - left, job->bottom - job->top, dzi->ch};
+    tile.pix = malloc(get_image_size(tile));
+    if (tile.pix == NULL)
+    {
+        __atomic_store_n(&dzi->failed, true, __ATOMIC_RELAXED);
+        return;
+    }
+    size_t stride = (size_t)level->w * dzi->ch, tile_stride = (size_t)tile.w * dzi->ch;
+    const uint8_t *from = level->rows + (size_t)(job->top - level->first_row) * stride + (size_t)left * dzi->ch;
+    for (int row = 0; row < tile.h; row++)
+        memcpy(tile.pix + row * tile_stride, from + row * stride, tile_stride);
+
+    char path[strlen(dzi->base) + 64];
+    snprintf(path, sizeof(path), "%s_files/%d/%d_%d.jpg", dzi->base, job->level, c, level->tile_row);
+    output_target_t target = {path};
+    row_sink_t *sink = create_jpeg_sink(target, dzi->quality, 1);
+    if (!write_image_to_sink(tile, sink))
+        __atomic_store_n(&dzi->failed, true, __ATOMIC_RELAXED);
+    free_row_sink(sink);
+    free(tile.pix);
+}
+
+static void push_dzi_row(dzi_sink_t *dzi, int l, const uint8_t *row);
+
+// averages pairs of pixels of two rows into the next level, an odd last pixel with itself
+static void halve_dzi_rows(dzi_sink_t *dzi, int l, const uint8_t *a, const uint8_t *b)
+{
+    dzi_level_t *level = &dzi->levels[l];
+    int ch = dzi->ch, w = level->w;
+    uint8_t *to = level->halved;
+
+    for (int x = 0; x < w; x += 2, to += ch)
+    {
+        int right = x + 1 < w ? ch : 0;
+        const uint8_t *pa = a + x * ch, *pb = b + x * ch;
+        for (int c = 0; c < ch; c++)
+            to[c] = (pa[c] + pa[c + right] + pb[c] + pb[c + right] + 2) / 4;
+    }
+    push_dzi_row(dzi, l - 1, level->halved);
+}
+
+// number of rows of tiles of a level
+static int get_dzi_tile_rows(const dzi_level_t *level)
+{
+    return (level->h + DZI_TILE_SIZE - 1) / DZI_TILE_SIZE;
+}
+
+/*
+ * Writes the rows of tiles of level l whose rows are all held. The overlap
+ * kept from one row of tiles can already complete the next, the last row
+ * of tiles of a height of 1 mod the tile size has no rows of its own.
+ */
+static void write_dzi_tile_rows(dzi_sink_t *dzi, int l)
+{
+    dzi_level_t *level = &dzi->levels[l];
+    size_t stride = (size_t)level->w * dzi->ch;
+
+    while (level->tile_row < get_dzi_tile_rows(level))
+    {
+        int top = level->tile_row * DZI_TILE_SIZE - DZI_OVERLAP,
+            bottom = (level->tile_row + 1) * DZI_TILE_SIZE + DZI_OVERLAP;
+        top = top > 0 ? top : 0;
+        bottom = bottom < level->h ? bottom : level->h;
+        if (level->first_row + level->row_count < bottom)
+            return;
+
+        tile_row_job_t job = {dzi, l, top, bottom};
+        int columns = (level->w + DZI_TILE_SIZE - 1) / DZI_TILE_SIZE;
+        if (dzi->pool != NULL)
+            thread_pool_run(dzi->pool, columns, write_dzi_tile, &job);
+        else
+            for (int c = 0; c < columns; c++)
+                write_dzi_tile(c, &job);
+
+        // the overlap rows stay for the next row of tiles
+        int next_top = (level->tile_row + 1) * DZI_TILE_SIZE - DZI_OVERLAP;
+        int keep = bottom - next_top > 0 ? bottom - next_top : 0;
+        memmove(level->rows, level->rows + (level->row_count - keep) * stride, keep * stride);
+        level->first_row = bottom - keep;
+        level->row_count = keep;
+        level->tile_row++;
+    }
+}
+
+// adds the next row of level l, writes its rows of tiles when complete
+static void push_dzi_row(dzi_sink_t *dzi, int l, const uint8_t *row)
+{
+    dzi_level_t *level = &dzi->levels[l];
+    size_t stride = (size_t)level->w * dzi->ch;
+    memcpy(level->rows + level->row_count * stride, row, stride);
+    level->row_count++;
+    write_dzi_tile_rows(dzi, l);
+
+    if (l == 0)
+        return;
+    if (level->has_pending)
+    {
+        halve_dzi_rows(dzi, l, level->pending, row);
+        level->has_pending = false;
+    }
+    else
+    {
+        memcpy(level->pending, row, stride);
+        level->has_pending = true;
+    }
+}
+
+static bool dzi_sink_begin(row_sink_t *sink, int w, int h, int ch)
+{
+    dzi_sink_t *dzi = sink->state;
+    const char *path = dzi->target.path;
+    if (path == NULL || dzi->target.stream != NULL || dzi->target.memory != NULL)
+    {
+        fprintf(stderr, "ERR: a dzi pyramid can only be written to a path\n");
+        return false;
+    }
+
+    size_t length = strlen(path);
+    if (length > 4 && strcasecmp(path + length - 4, ".dzi") == 0)
+        length -= 4;
+    dzi->ch = ch;
+
+    // levels down to 1x1, every level half of the next rounded up
+    dzi->level_count = 1;
+    for (int size = w > h ? w : h; size > 1; size = (size + 1) / 2)
+        dzi->level_count++;
+
+    dzi->base = malloc(length + 1);
+    dzi->levels = calloc(dzi->level_count, sizeof(dzi_level_t));
+    if (dzi->base == NULL || dzi->levels == NULL)
+    {
+        fprintf(stderr, "ERR: out of memory for %s\n", path);
+        return false;
+    }
+    memcpy(dzi->base, path, length);
+    dzi->base[length] = '\0';
+
+    char directory[length + 64];
+    snprintf(directory, sizeof(directory), "%s_files", dzi->base);
+    bool success = make_directory(directory);
+    for (int l = dzi->level_count - 1, lw = w, lh = h; l >= 0; l--, lw = (lw + 1) / 2, lh = (lh + 1) / 2)
+    {
+        dzi_level_t *level = &dzi->levels[l];
+        size_t stride = (size_t)lw * ch;
+        level->w = lw;
+        level->h = lh;
+        level->rows = malloc((DZI_TILE_SIZE + 2 * DZI_OVERLAP) * stride);
+        level->pending = malloc(stride);
+        level->halved = malloc(((lw + 1) / 2) * ch);
+
+        snprintf(directory, sizeof(directory), "%s_files/%d", dzi->base, l);
+        if (level->rows == NULL || level->pending == NULL || level->halved == NULL)
+        {
+            fprintf(stderr, "ERR: out of memory for %s\n", path);
+            success = false;
+        }
+        success = success && make_directory(directory);
+    }
+    if (!success)
+        return false;
+
+    FILE *descriptor = fopen(path, "w");
+    if (descriptor == NULL)
+    {
+        fprintf(stderr, "ERR: could not open %s\n", path);
+        return false;
+    }
+    fprintf(descriptor, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                        "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\"jpg\" "
+                        "Overlap=\"%d\" TileSize=\"%d\">\n"
+                        "  <Size Width=\"%d\" Height=\"%d\"/>\n"
+                        "</Image>\n",
+            DZI_OVERLAP, DZI_TILE_SIZE, w, h);
+    if (fclose(descriptor) != 0)
+        return false;
+
+    dzi->pool = thread_pool_create(dzi->threads);
+    dzi->rows_written = 0;
+    return true;
+}
+
+static bool dzi_sink_write_rows(row_sink_t *sink, const uint8_t *rows, int count)
+{
+    dzi_sink_t *dzi = sink->state;
+    dzi_level_t *full = &dzi->levels[dzi->level_count - 1];
+    size_t stride = (size_t)full->w * dzi->ch;
+    if (dzi->rows_written + count > full->h)
+        return false;
+
+    for (int row = 0; row < count; row++)
+        push_dzi_row(dzi, dzi->level_count - 1, rows + row * stride);
+    dzi->rows_written += count;
+    return !dzi->failed;
+}
+
+static bool dzi_sink_end(row_sink_t *sink)
+{
+    dzi_sink_t *dzi = sink->state;
+
+    // an odd last row of a level is averaged with itself
+    for (int l = dzi->level_count - 1; l > 0; l--)
+    {
+        dzi_level_t *level = &dzi->levels[l];
+        if (level->has_pending)
+        {
+            level->has_pending = false;
+            halve_dzi_rows(dzi, l, level->pending, level->pending);
+        }
+    }
+    bool complete = dzi->rows_written == dzi->levels[dzi->level_count - 1].h;
+    for (int l = 0; l < dzi->level_count; l++)
+        complete = complete && dzi->levels[l].tile_row == get_dzi_tile_rows(&dzi->levels[l]);
+
+    if (dzi->failed || !complete)
+        fprintf(stderr, "ERR: could not write all tiles of %s\n", dzi->target.path);
+    return !dzi->failed && complete;
+}
+
+static void dzi_sink_destroy(row_sink_t *sink)
+{
+    dzi_sink_t *dzi = sink->state;
+    for (int l = 0; dzi->levels != NULL && l < dzi->level_count; l++)
+    {
+        free(dzi->levels[l].rows);
+        free(dzi->levels[l].pending);
+        free(dzi->levels[l].halved);
+    }
+    free(dzi->levels);
+    free(dzi->base);
+    thread_pool_destroy(dzi->pool);
+    free(dzi);
+    free(sink);
+}
+
+/*
+ * Sink that writes a Deep Zoom pyramid of jpeg tiles (quality) next to the
+ * .dzi at the path of target, the tiles of a row in parallel on threads.
+ */
+row_sink_t *create_dzi_sink(output_target_t target, int quality, int threads)
+{
+    row_sink_t *sink = malloc(sizeof(row_sink_t));
+    dzi_sink_t *dzi = calloc(1, sizeof(dzi_sink_t));
+    dzi->target = target;
+    dzi->quality = quality;
+    dzi->threads = threads;
+
+    sink->begin = dzi_sink_begin;
+    sink->write_rows = dzi_sink_write_rows;
+    sink->end = dzi_sink_end;
+    sink->destroy = dzi_sink_destroy;
+    sink->state = dzi;
+    return sink;
+}
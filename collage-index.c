@@ -0,0 +1,1229 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <float.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+#include "collage.h"
+
+/*
+ * Search indexes over the photo descriptors of a multi collage. They are
+ * built once after all photos are loaded (build_tile_indexes) and answer
+ * k-nearest queries that skip not allowed photos.
+ */
+
+static const int KD_LEAF_SIZE = 8;
+static const int BATCH_SIMD_WIDTH = 8;
+static const int BATCH_TILE_BLOCK = 1024; // photos per block, stays in L2
+static const int BATCH_CELL_BLOCK = 64;   // cells that reuse a photo block
+static const int IVF_SUBSPACES = 4;       // one per quadrant, both distances are sums over them
+static const int IVF_CODEBOOK_SIZE = 256; // one byte codes
+static const int IVF_DEFAULT_PROBES = 8;
+static const int IVF_MAX_PROBES = 1024;
+static const int IVF_TRAIN_ITERATIONS = 8;
+static const int IVF_TRAIN_SAMPLES = 32; // per centroid
+static const int IVF_SHORTLIST = 4;      // approximate results per result, re-ranked exactly
+static const int IVF_MIN_SHORTLIST = 32;
+static const int IVF_MAX_STACK_SHORTLIST = 256; // larger shortlists are allocated per query
+
+/* Helper methods */
+
+// moves the k-th smallest key (and its id) to position k, smaller ones before
+static void select_kth(float *keys, int *ids, int n, int k)
+{
+    int lo = 0, hi = n - 1;
+    while (lo < hi)
+    {
+        float pivot = keys[(lo + hi) / 2];
+        int i = lo, j = hi;
+        while (i <= j)
+        {
+            while (keys[i] < pivot)
+                i++;
+            while (keys[j] > pivot)
+                j--;
+            if (i <= j)
+            {
+                float key = keys[i];
+                keys[i] = keys[j];
+                keys[j] = key;
+                int id = ids[i];
+                ids[i] = ids[j];
+                ids[j] = id;
+                i++;
+                j--;
+            }
+        }
+        if (k <= j)
+            hi = j;
+        else if (k >= i)
+            lo = i;
+        else
+            break;
+    }
+}
+
+typedef struct
+{
+    int k, found;
+    int *ids;
+    float *distances;
+} knn_t;
+
+static inline float knn_worst(knn_t *result)
+{
+    return result->found < result->k ? FLT_MAX : result->distances[result->found - 1];
+}
+
+// keeps the k best (distance, id) pairs sorted, equal distances by ascending id
+static inline void knn_insert(knn_t *result, int id, float d)
+{
+    int pos = result->found;
+    if (pos == result->k)
+    {
+        float worst = result->distances[pos - 1];
+        if (d > worst || (d == worst && id > result->ids[pos - 1]))
+            return;
+        pos--;
+    }
+    else
+    {
+        result->found++;
+    }
+
+    while (pos > 0 && (result->distances[pos - 1] > d ||
+                       (result->distances[pos - 1] == d && result->ids[pos - 1] > id)))
+    {
+        result->distances[pos] = result->distances[pos - 1];
+        result->ids[pos] = result->ids[pos - 1];
+        pos--;
+    }
+    result->distances[pos] = d;
+    result->ids[pos] = id;
+}
+
+/* Pruned scan */
+
+/*
+ * The L1 distance of two shapes is at least the difference of their sums,
+ * so with the shapes sorted by sum the scan walks outwards from the sum of
+ * the query and stops once that bound exceeds the best distance found.
+ */
+
+static const float SHAPE_SCAN_MARGIN = 1e-5f; // rounding of the sums
+
+typedef struct
+{
+    float sum;
+    int id;
+} sum_entry_t;
+
+static int compare_sum_entries(const void *a, const void *b)
+{
+    const sum_entry_t *ea = a, *eb = b;
+    if (ea->sum != eb->sum)
+        return (ea->sum > eb->sum) - (ea->sum < eb->sum);
+    return ea->id - eb->id;
+}
+
+static inline float get_shape_sum(const image_shape_t *S)
+{
+    return S->y1 + S->y2 + S->y3 + S->y4;
+}
+
+// default shapes (photos that failed to load) are left out
+void build_shape_scan(shape_scan_t *scan, const image_shape_t *structure, int count)
+{
+    sum_entry_t *entries = malloc((count > 0 ? count : 1) * sizeof(sum_entry_t));
+    int n = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (is_default_shape(structure[i]))
+            continue;
+        entries[n].sum = get_shape_sum(&structure[i]);
+        entries[n].id = i;
+        n++;
+    }
+    qsort(entries, n, sizeof(sum_entry_t), compare_sum_entries);
+
+    scan->count = n;
+    scan->ids = malloc((n > 0 ? n : 1) * sizeof(int));
+    scan->sum = malloc((n > 0 ? n : 1) * sizeof(float));
+    scan->structure = malloc((n > 0 ? n : 1) * sizeof(image_shape_t));
+    for (int i = 0; i < n; i++)
+    {
+        scan->ids[i] = entries[i].id;
+        scan->sum[i] = entries[i].sum;
+        scan->structure[i] = structure[entries[i].id];
+    }
+    free(entries);
+}
+
+// nearest allowed shape, the lower id on ties like match_image_by_shape, -1 if none
+int shape_scan_nearest(const shape_scan_t *scan, image_shape_t S, const exclusion_t *exclusion)
+{
+    float sum = get_shape_sum(&S);
+    int begin = 0, end = scan->count;
+    while (begin < end)
+    {
+        int middle = begin + (end - begin) / 2;
+        if (scan->sum[middle] < sum)
+            begin = middle + 1;
+        else
+            end = middle;
+    }
+
+    int best_image = -1;
+    float best_distance = INFINITY;
+    int up = begin, down = begin - 1;
+    while (up < scan->count || down >= 0)
+    {
+        // the side with the smaller bound first, the bounds only grow
+        float bound_up = up < scan->count ? scan->sum[up] - sum : INFINITY;
+        float bound_down = down >= 0 ? sum - scan->sum[down] : INFINITY;
+        int i;
+        float bound;
+        if (bound_up <= bound_down)
+        {
+            i = up++;
+            bound = bound_up;
+        }
+        else
+        {
+            i = down--;
+            bound = bound_down;
+        }
+        if (bound - SHAPE_SCAN_MARGIN > best_distance)
+            break;
+
+        int k = scan->ids[i];
+        if (is_excluded(exclusion, k))
+            continue;
+
+        float d = shape_difference_below(&S, &scan->structure[i], best_distance);
+        if (d < best_distance || (d == best_distance && k < best_image))
+        {
+            best_distance = d;
+            best_image = k;
+        }
+    }
+    return best_image;
+}
+
+void free_shape_scan(shape_scan_t *scan)
+{
+    free(scan->ids);
+    free(scan->sum);
+    free(scan->structure);
+    *scan = shape_scan_default;
+}
+
+/* Luminance index */
+
+typedef struct
+{
+    float luminance;
+    int id;
+} luminance_entry_t;
+
+static int compare_luminance_entries(const void *a, const void *b)
+{
+    const luminance_entry_t *ea = a, *eb = b;
+    if (ea->luminance != eb->luminance)
+        return (ea->luminance > eb->luminance) - (ea->luminance < eb->luminance);
+    return ea->id - eb->id;
+}
+
+// photos sorted by luminance, photos that failed to load (luminance 0) are left out
+void build_luminance_index(luminance_index_t *index, const float *luminance, int count)
+{
+    luminance_entry_t *entries = malloc((count > 0 ? count : 1) * sizeof(luminance_entry_t));
+    int n = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (luminance[i] == 0)
+            continue;
+        entries[n].luminance = luminance[i];
+        entries[n].id = i;
+        n++;
+    }
+    qsort(entries, n, sizeof(luminance_entry_t), compare_luminance_entries);
+
+    index->count = n;
+    index->ids = malloc((n > 0 ? n : 1) * sizeof(int));
+    index->luminance = malloc((n > 0 ? n : 1) * sizeof(float));
+    for (int i = 0; i < n; i++)
+    {
+        index->ids[i] = entries[i].id;
+        index->luminance[i] = entries[i].luminance;
+    }
+    free(entries);
+}
+
+/*
+ * k nearest by descriptor among the shortlist allowed photos closest to
+ * luminance Y (coarse to fine). Only the shortlist is compared with the
+ * full descriptors, so photos of a different luminance are never found.
+ */
+int luminance_shortlist_nearest(const luminance_index_t *index, descriptor_t type, const float *descriptors,
+                                float Y, const float *descriptor, int shortlist,
+                                int k, int *ids, float *distances, const exclusion_t *exclusion)
+{
+    knn_t result = {k, 0, ids, distances};
+    int dim = get_descriptor_dimension(type);
+    if (k <= 0)
+        return 0;
+    if (shortlist < k)
+        shortlist = k;
+
+    int begin = 0, end = index->count;
+    while (begin < end)
+    {
+        int middle = begin + (end - begin) / 2;
+        if (index->luminance[middle] < Y)
+            begin = middle + 1;
+        else
+            end = middle;
+    }
+
+    // outwards from Y, the closer side first
+    int up = begin, down = begin - 1;
+    for (int listed = 0; listed < shortlist && (up < index->count || down >= 0);)
+    {
+        int i;
+        if (down < 0 || (up < index->count && index->luminance[up] - Y <= Y - index->luminance[down]))
+            i = up++;
+        else
+            i = down--;
+
+        int id = index->ids[i];
+        if (is_excluded(exclusion, id))
+            continue;
+        listed++;
+
+        float d = get_descriptor_difference(type, descriptor, descriptors + (size_t)id * dim);
+        if (d <= knn_worst(&result))
+            knn_insert(&result, id, d);
+    }
+    return result.found;
+}
+
+void free_luminance_index(luminance_index_t *index)
+{
+    free(index->ids);
+    free(index->luminance);
+    *index = luminance_index_default;
+}
+
+/* Linear scan */
+
+// k nearest of count descriptors of type, for matchers without an index
+int linear_nearest(descriptor_t type, const float *descriptors, int count, const float *descriptor,
+                   int k, int *ids, float *distances, const exclusion_t *exclusion)
+{
+    knn_t result = {k, 0, ids, distances};
+    int dim = get_descriptor_dimension(type);
+    if (k <= 0)
+        return 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        const float *other = descriptors + (size_t)i * dim;
+        bool is_default = true;
+        for (int d = 0; d < dim; d++)
+        {
+            if (other[d] != 0)
+                is_default = false;
+        }
+        if (is_default || is_excluded(exclusion, i))
+            continue;
+
+        float d = get_descriptor_difference(type, descriptor, other);
+        if (d <= knn_worst(&result))
+            knn_insert(&result, i, d);
+    }
+    return result.found;
+}
+
+/* k-d tree */
+
+static int kd_build_node(kd_tree_t *tree, float *keys, int begin, int end)
+{
+    int n = tree->node_count++;
+    kd_node_t *node = &tree->nodes[n];
+    node->begin = begin;
+    node->end = end;
+    node->left = -1;
+    node->right = -1;
+
+    for (int d = 0; d < 4; d++)
+    {
+        node->min[d] = FLT_MAX;
+        node->max[d] = -FLT_MAX;
+    }
+    for (int i = begin; i < end; i++)
+    {
+        const float *s = (const float *)&tree->structure[tree->ids[i]];
+        for (int d = 0; d < 4; d++)
+        {
+            if (s[d] < node->min[d])
+                node->min[d] = s[d];
+            if (s[d] > node->max[d])
+                node->max[d] = s[d];
+        }
+    }
+
+    if (end - begin <= KD_LEAF_SIZE)
+        return n;
+
+    // split at the median of the widest dimension
+    int split_dim = 0;
+    for (int d = 1; d < 4; d++)
+    {
+        if (node->max[d] - node->min[d] > node->max[split_dim] - node->min[split_dim])
+            split_dim = d;
+    }
+
+    for (int i = begin; i < end; i++)
+        keys[i] = ((const float *)&tree->structure[tree->ids[i]])[split_dim];
+
+    int mid = begin + (end - begin) / 2;
+    select_kth(keys + begin, tree->ids + begin, end - begin, mid - begin);
+
+    int left = kd_build_node(tree, keys, begin, mid);
+    int right = kd_build_node(tree, keys, mid, end);
+    tree->nodes[n].left = left;
+    tree->nodes[n].right = right;
+    return n;
+}
+
+void build_kd_tree(kd_tree_t *tree, image_shape_t *images_structure, int count)
+{
+    *tree = kd_tree_default;
+    tree->structure = images_structure;
+    tree->ids = malloc(count * sizeof(int));
+
+    int valid = 0;
+    for (int k = 0; k < count; k++)
+    {
+        if (!is_default_shape(images_structure[k]))
+            tree->ids[valid++] = k;
+    }
+
+    if (valid == 0)
+        return;
+
+    float *keys = malloc(valid * sizeof(float));
+    tree->nodes = malloc(2 * valid * sizeof(kd_node_t));
+    kd_build_node(tree, keys, 0, valid);
+    free(keys);
+}
+
+// L1 distance from S to the bounding box of node
+static inline float kd_box_distance(const kd_node_t *node, const float *S)
+{
+    float d = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        if (S[i] < node->min[i])
+            d += node->min[i] - S[i];
+        else if (S[i] > node->max[i])
+            d += S[i] - node->max[i];
+    }
+    return d;
+}
+
+static void kd_search(kd_tree_t *tree, int n, const image_shape_t *S, knn_t *result,
+                      const exclusion_t *exclusion)
+{
+    kd_node_t *node = &tree->nodes[n];
+
+    if (node->left < 0)
+    {
+        for (int i = node->begin; i < node->end; i++)
+        {
+            int id = tree->ids[i];
+            if (is_excluded(exclusion, id))
+                continue;
+            knn_insert(result, id, shape_difference(S, &tree->structure[id]));
+        }
+        return;
+    }
+
+    int first = node->left, second = node->right;
+    float first_d = kd_box_distance(&tree->nodes[first], (const float *)S),
+          second_d = kd_box_distance(&tree->nodes[second], (const float *)S);
+    if (second_d < first_d)
+    {
+        first = node->right;
+        second = node->left;
+        float d = first_d;
+        first_d = second_d;
+        second_d = d;
+    }
+
+    if (first_d <= knn_worst(result))
+        kd_search(tree, first, S, result, exclusion);
+    if (second_d <= knn_worst(result))
+        kd_search(tree, second, S, result, exclusion);
+}
+
+/*
+ * Writes the k nearest allowed photos (ascending distance) to ids and
+ * distances and returns how many were found.
+ */
+int kd_tree_nearest(kd_tree_t *tree, image_shape_t S, int k, int *ids, float *distances,
+                    const exclusion_t *exclusion)
+{
+    knn_t result = {k, 0, ids, distances};
+    if (tree->node_count > 0 && k > 0)
+        kd_search(tree, 0, &S, &result, exclusion);
+    return result.found;
+}
+
+void free_kd_tree(kd_tree_t *tree)
+{
+    free(tree->nodes);
+    free(tree->ids);
+    *tree = kd_tree_default;
+}
+
+/* VP-tree */
+
+static int vp_build_node(vp_tree_t *tree, int *ids, float *keys, int begin, int end, unsigned int *seed)
+{
+    if (begin >= end)
+        return -1;
+
+    // random vantage point keeps the tree balanced for sorted input
+    int pick = begin + rand_r(seed) % (end - begin);
+    int id = ids[pick];
+    ids[pick] = ids[begin];
+    ids[begin] = id;
+
+    int n = tree->node_count++;
+    tree->nodes[n].id = id;
+    tree->nodes[n].mu = 0;
+    tree->nodes[n].inside = -1;
+    tree->nodes[n].outside = -1;
+
+    begin++;
+    if (begin == end)
+        return n;
+
+    int dim = get_descriptor_dimension(tree->type);
+    const float *vantage = tree->descriptors + id * dim;
+    for (int i = begin; i < end; i++)
+        keys[i] = get_descriptor_difference(tree->type, vantage, tree->descriptors + ids[i] * dim);
+
+    int mid = begin + (end - begin) / 2;
+    select_kth(keys + begin, ids + begin, end - begin, mid - begin);
+    tree->nodes[n].mu = keys[mid];
+
+    int inside = vp_build_node(tree, ids, keys, begin, mid + 1, seed);
+    int outside = vp_build_node(tree, ids, keys, mid + 1, end, seed);
+    tree->nodes[n].inside = inside;
+    tree->nodes[n].outside = outside;
+    return n;
+}
+
+/*
+ * descriptors is an array of count image_shape_t or image_color_t, depending
+ * on type. It has to outlive the tree.
+ */
+void build_vp_tree(vp_tree_t *tree, descriptor_t type, const float *descriptors, int count)
+{
+    *tree = vp_tree_default;
+    tree->type = type;
+    tree->descriptors = descriptors;
+
+    int dim = get_descriptor_dimension(type);
+    int *ids = malloc(count * sizeof(int));
+    int valid = 0;
+    for (int k = 0; k < count; k++)
+    {
+        bool is_default = true;
+        for (int d = 0; d < dim; d++)
+        {
+            if (descriptors[k * dim + d] != 0)
+                is_default = false;
+        }
+        if (!is_default)
+            ids[valid++] = k;
+    }
+
+    if (valid > 0)
+    {
+        unsigned int seed = 1;
+        float *keys = malloc(valid * sizeof(float));
+        tree->nodes = malloc(valid * sizeof(vp_node_t));
+        tree->root = vp_build_node(tree, ids, keys, 0, valid, &seed);
+        free(keys);
+    }
+    free(ids);
+}
+
+static void vp_search(vp_tree_t *tree, int n, const float *descriptor, knn_t *result,
+                      const exclusion_t *exclusion)
+{
+    vp_node_t *node = &tree->nodes[n];
+    int dim = get_descriptor_dimension(tree->type);
+    float d = get_descriptor_difference(tree->type, descriptor, tree->descriptors + node->id * dim);
+
+    if (!is_excluded(exclusion, node->id))
+        knn_insert(result, node->id, d);
+
+    // triangle inequality: inside is at least d - mu away, outside mu - d
+    if (d <= node->mu)
+    {
+        if (node->inside >= 0 && d - node->mu <= knn_worst(result))
+            vp_search(tree, node->inside, descriptor, result, exclusion);
+        if (node->outside >= 0 && node->mu - d <= knn_worst(result))
+            vp_search(tree, node->outside, descriptor, result, exclusion);
+    }
+    else
+    {
+        if (node->outside >= 0 && node->mu - d <= knn_worst(result))
+            vp_search(tree, node->outside, descriptor, result, exclusion);
+        if (node->inside >= 0 && d - node->mu <= knn_worst(result))
+            vp_search(tree, node->inside, descriptor, result, exclusion);
+    }
+}
+
+int vp_tree_nearest(vp_tree_t *tree, const float *descriptor, int k, int *ids, float *distances,
+                    const exclusion_t *exclusion)
+{
+    knn_t result = {k, 0, ids, distances};
+    if (tree->root >= 0 && k > 0)
+        vp_search(tree, tree->root, descriptor, &result, exclusion);
+    return result.found;
+}
+
+void free_vp_tree(vp_tree_t *tree)
+{
+    free(tree->nodes);
+    *tree = vp_tree_default;
+}
+
+/* Batch matcher */
+
+void build_batch_index(batch_index_t *index, descriptor_t type, const float *descriptors, int count)
+{
+    *index = batch_index_default;
+    index->type = type;
+    index->dim = get_descriptor_dimension(type);
+    index->ids = malloc(count * sizeof(int));
+
+    for (int k = 0; k < count; k++)
+    {
+        bool is_default = true;
+        for (int d = 0; d < index->dim; d++)
+        {
+            if (descriptors[k * index->dim + d] != 0)
+                is_default = false;
+        }
+        if (!is_default)
+            index->ids[index->count++] = k;
+    }
+
+    index->stride = (index->count + BATCH_SIMD_WIDTH - 1) / BATCH_SIMD_WIDTH * BATCH_SIMD_WIDTH;
+    index->data = calloc((size_t)index->dim * index->stride, sizeof(float));
+    for (int t = 0; t < index->count; t++)
+    {
+        for (int d = 0; d < index->dim; d++)
+            index->data[(size_t)d * index->stride + t] = descriptors[index->ids[t] * index->dim + d];
+    }
+}
+
+/*
+ * Distance kernels over the columns [begin, end) of the index. Both sum in
+ * the same order as shape_difference / color_difference, so the distances
+ * are bit-identical to the scalar ones.
+ */
+static void l1_block(const batch_index_t *index, const float *query, int begin, int end, float *out)
+{
+    for (int t = begin; t < end; t++)
+    {
+        float d = 0;
+        for (int i = 0; i < index->dim; i++)
+            d += fabsf(index->data[(size_t)i * index->stride + t] - query[i]);
+        out[t - begin] = d;
+    }
+}
+
+static void lab_block(const batch_index_t *index, const float *query, int begin, int end, float *out)
+{
+    const image_color_t *C = (const image_color_t *)query;
+    for (int t = begin; t < end; t++)
+    {
+        float e[4];
+        for (int q = 0; q < 4; q++)
+        {
+            float dl = index->data[(size_t)q * index->stride + t] - C->l[q],
+                  da = index->data[(size_t)(4 + q) * index->stride + t] - C->a[q],
+                  db = index->data[(size_t)(8 + q) * index->stride + t] - C->b[q];
+            e[q] = sqrtf(LAB_WEIGHT_L * (dl * dl) + LAB_WEIGHT_A * (da * da) + LAB_WEIGHT_B * (db * db));
+        }
+        out[t - begin] = (e[0] + e[2]) + (e[1] + e[3]);
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2"))) static void l1_block_avx2(
+    const batch_index_t *index, const float *query, int begin, int end, float *out)
+{
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    for (int t = begin; t < end; t += 8)
+    {
+        __m256 d = _mm256_setzero_ps();
+        for (int i = 0; i < index->dim; i++)
+        {
+            __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(index->data + (size_t)i * index->stride + t),
+                                        _mm256_set1_ps(query[i]));
+            d = _mm256_add_ps(d, _mm256_andnot_ps(sign, diff));
+        }
+        _mm256_storeu_ps(out + t - begin, d);
+    }
+}
+
+__attribute__((target("avx2"))) static void lab_block_avx2(
+    const batch_index_t *index, const float *query, int begin, int end, float *out)
+{
+    const image_color_t *C = (const image_color_t *)query;
+    const __m256 wl = _mm256_set1_ps(LAB_WEIGHT_L),
+                 wa = _mm256_set1_ps(LAB_WEIGHT_A),
+                 wb = _mm256_set1_ps(LAB_WEIGHT_B);
+    for (int t = begin; t < end; t += 8)
+    {
+        __m256 e[4];
+        for (int q = 0; q < 4; q++)
+        {
+            __m256 dl = _mm256_sub_ps(_mm256_loadu_ps(index->data + (size_t)q * index->stride + t),
+                                      _mm256_set1_ps(C->l[q]));
+            __m256 da = _mm256_sub_ps(_mm256_loadu_ps(index->data + (size_t)(4 + q) * index->stride + t),
+                                      _mm256_set1_ps(C->a[q]));
+            __m256 db = _mm256_sub_ps(_mm256_loadu_ps(index->data + (size_t)(8 + q) * index->stride + t),
+                                      _mm256_set1_ps(C->b[q]));
+            __m256 sum = _mm256_mul_ps(wl, _mm256_mul_ps(dl, dl));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(wa, _mm256_mul_ps(da, da)));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(wb, _mm256_mul_ps(db, db)));
+            e[q] = _mm256_sqrt_ps(sum);
+        }
+        _mm256_storeu_ps(out + t - begin,
+                         _mm256_add_ps(_mm256_add_ps(e[0], e[2]), _mm256_add_ps(e[1], e[3])));
+    }
+}
+#endif
+
+typedef void (*distance_block_t)(const batch_index_t *, const float *, int, int, float *);
+
+static distance_block_t get_distance_block(descriptor_t type)
+{
+#ifdef HAVE_X86_SIMD
+    if (__builtin_cpu_supports("avx2"))
+        return type == DESCRIPTOR_COLOR ? lab_block_avx2 : l1_block_avx2;
+#endif
+    return type == DESCRIPTOR_COLOR ? lab_block : l1_block;
+}
+
+/*
+ * Top-k photos for every cell descriptor (candidates->count descriptors of
+ * the index type). Cells and photos are processed in blocks so a block of
+ * photo descriptors is reused by many cells while it is in cache.
+ */
+void batch_nearest(batch_index_t *index, const float *descriptors, candidate_list_t *candidates)
+{
+    distance_block_t distance_block = get_distance_block(index->type);
+    float *distances = malloc(BATCH_TILE_BLOCK * sizeof(float));
+
+    for (int c = 0; c < candidates->count; c++)
+        candidates->found[c] = 0;
+
+    for (int cell_begin = 0; cell_begin < candidates->count; cell_begin += BATCH_CELL_BLOCK)
+    {
+        int cell_end = cell_begin + BATCH_CELL_BLOCK < candidates->count ? cell_begin + BATCH_CELL_BLOCK : candidates->count;
+
+        for (int tile_begin = 0; tile_begin < index->count; tile_begin += BATCH_TILE_BLOCK)
+        {
+            int tile_end = tile_begin + BATCH_TILE_BLOCK < index->stride ? tile_begin + BATCH_TILE_BLOCK : index->stride;
+            int valid_end = tile_end < index->count ? tile_end : index->count;
+
+            for (int c = cell_begin; c < cell_end; c++)
+            {
+                knn_t result = {
+                    candidates->k, candidates->found[c],
+                    candidates->ids + (size_t)c * candidates->k,
+                    candidates->distances + (size_t)c * candidates->k};
+
+                distance_block(index, descriptors + (size_t)c * index->dim, tile_begin, tile_end, distances);
+
+                float worst = knn_worst(&result);
+                for (int t = tile_begin; t < valid_end; t++)
+                {
+                    if (distances[t - tile_begin] <= worst)
+                    {
+                        knn_insert(&result, index->ids[t], distances[t - tile_begin]);
+                        worst = knn_worst(&result);
+                    }
+                }
+                candidates->found[c] = result.found;
+            }
+        }
+    }
+
+    free(distances);
+}
+
+void free_batch_index(batch_index_t *index)
+{
+    free(index->ids);
+    free(index->data);
+    *index = batch_index_default;
+}
+
+/* Inverted file with product quantization */
+
+/*
+ * Quadrant q of a descriptor: shape y_q (1 float) or colour l, a, b of q
+ * (3 floats). The squared quadrant distance has the same minimum as the
+ * real one, which is its square root.
+ */
+static inline void get_subvector(const float *descriptor, int q, int sub_dim, float *out)
+{
+    for (int s = 0; s < sub_dim; s++)
+        out[s] = descriptor[q + IVF_SUBSPACES * s];
+}
+
+static float subspace_difference(descriptor_t type, const float *a, const float *b)
+{
+    if (type == DESCRIPTOR_COLOR)
+    {
+        float dl = a[0] - b[0], da = a[1] - b[1], db = a[2] - b[2];
+        return LAB_WEIGHT_L * dl * dl + LAB_WEIGHT_A * da * da + LAB_WEIGHT_B * db * db;
+    }
+    return (a[0] - b[0]) * (a[0] - b[0]);
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+    float fa = *(const float *)a, fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+// nearest code of a quadrant by comparing all codes, for codebooks in training
+static int nearest_unsorted_code(descriptor_t type, const float *subvector, const float *codebook, int size,
+                                 int sub_dim)
+{
+    int best = 0;
+    float best_distance = FLT_MAX;
+    for (int c = 0; c < size; c++)
+    {
+        float d = subspace_difference(type, subvector, codebook + (size_t)c * sub_dim);
+        if (d < best_distance)
+        {
+            best_distance = d;
+            best = c;
+        }
+    }
+    return best;
+}
+
+// nearest code of a quadrant in a trained codebook, single floats are sorted
+static int nearest_code(descriptor_t type, const float *subvector, const float *codebook, int size, int sub_dim)
+{
+    if (sub_dim == 1)
+    {
+        int lo = 0, hi = size - 1;
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (codebook[mid] < subvector[0])
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo > 0 && subvector[0] - codebook[lo - 1] <= codebook[lo] - subvector[0])
+            lo--;
+        return lo;
+    }
+    return nearest_unsorted_code(type, subvector, codebook, size, sub_dim);
+}
+
+// nearest centroid of every point, points and centroids of the size given by type
+typedef void (*assign_points_t)(descriptor_t type, const float *points, int count,
+                                const float *centroids, int centroid_count, int *nearest);
+
+// whole descriptors, with the batch matcher
+static void assign_descriptors(descriptor_t type, const float *points, int count,
+                               const float *centroids, int centroid_count, int *nearest)
+{
+    batch_index_t index;
+    build_batch_index(&index, type, centroids, centroid_count);
+    candidate_list_t result = alloc_candidate_list(1, count);
+    batch_nearest(&index, points, &result);
+    for (int p = 0; p < count; p++)
+        nearest[p] = result.found[p] > 0 ? result.ids[p] : 0;
+    free_candidate_list(&result);
+    free_batch_index(&index);
+}
+
+// quadrants, the centroids are unsorted during training
+static void assign_subvectors(descriptor_t type, const float *points, int count,
+                              const float *centroids, int centroid_count, int *nearest)
+{
+    int sub_dim = get_descriptor_dimension(type) / IVF_SUBSPACES;
+    for (int p = 0; p < count; p++)
+        nearest[p] = nearest_unsorted_code(type, points + (size_t)p * sub_dim, centroids, centroid_count, sub_dim);
+}
+
+/*
+ * Lloyd's k-means on count points of dim floats. Centroids start at random
+ * points, empty clusters are restarted at a random point. Returns the
+ * number of centroids, less than centroid_count for few points.
+ */
+static int train_kmeans(descriptor_t type, assign_points_t assign,
+                        const float *points, int count, int dim,
+                        float *centroids, int centroid_count, unsigned int *seed)
+{
+    if (centroid_count > count)
+        centroid_count = count;
+
+    int *order = malloc(count * sizeof(int));
+    for (int p = 0; p < count; p++)
+        order[p] = p;
+    for (int c = 0; c < centroid_count; c++)
+    {
+        int pick = c + rand_r(seed) % (count - c);
+        int p = order[pick];
+        order[pick] = order[c];
+        order[c] = p;
+        for (int d = 0; d < dim; d++)
+            centroids[(size_t)c * dim + d] = points[(size_t)p * dim + d];
+    }
+    free(order);
+
+    int *nearest = malloc(count * sizeof(int));
+    int *members = malloc(centroid_count * sizeof(int));
+    double *sums = malloc((size_t)centroid_count * dim * sizeof(double));
+    for (int iteration = 0; iteration < IVF_TRAIN_ITERATIONS; iteration++)
+    {
+        for (int c = 0; c < centroid_count; c++)
+            members[c] = 0;
+        for (size_t i = 0; i < (size_t)centroid_count * dim; i++)
+            sums[i] = 0;
+
+        assign(type, points, count, centroids, centroid_count, nearest);
+        for (int p = 0; p < count; p++)
+        {
+            members[nearest[p]]++;
+            for (int d = 0; d < dim; d++)
+                sums[(size_t)nearest[p] * dim + d] += points[(size_t)p * dim + d];
+        }
+
+        for (int c = 0; c < centroid_count; c++)
+        {
+            const float *point = members[c] > 0 ? NULL : points + (size_t)(rand_r(seed) % count) * dim;
+            for (int d = 0; d < dim; d++)
+                centroids[(size_t)c * dim + d] = point == NULL ? sums[(size_t)c * dim + d] / members[c] : point[d];
+        }
+    }
+
+    free(nearest);
+    free(members);
+    free(sums);
+    return centroid_count;
+}
+
+// at most sample_count of the ids (random, all if there are less)
+static int sample_ids(const int *ids, int count, int sample_count, int *sample, unsigned int *seed)
+{
+    for (int i = 0; i < count; i++)
+        sample[i] = ids[i];
+    if (sample_count >= count)
+        return count;
+
+    for (int i = 0; i < sample_count; i++)
+    {
+        int pick = i + rand_r(seed) % (count - i);
+        int id = sample[pick];
+        sample[pick] = sample[i];
+        sample[i] = id;
+    }
+    return sample_count;
+}
+
+/*
+ * Approximate index for large libraries: the photos are split into about
+ * sqrt(count) lists by k-means, every descriptor is stored as one byte per
+ * quadrant (product quantization). A query scans the probes nearest lists
+ * with a distance table per quadrant and re-ranks the best of them with
+ * the exact descriptors, which have to outlive the index.
+ */
+void build_ivf_index(ivf_index_t *index, descriptor_t type, const float *descriptors, int count, int probes)
+{
+    *index = ivf_index_default;
+    index->type = type;
+    index->dim = get_descriptor_dimension(type);
+    index->probes = probes > 0 ? probes : IVF_DEFAULT_PROBES;
+    index->descriptors = descriptors;
+
+    int dim = index->dim, sub_dim = dim / IVF_SUBSPACES;
+    int *valid_ids = malloc(count * sizeof(int));
+    int valid = 0;
+    for (int k = 0; k < count; k++)
+    {
+        bool is_default = true;
+        for (int d = 0; d < dim; d++)
+        {
+            if (descriptors[k * dim + d] != 0)
+                is_default = false;
+        }
+        if (!is_default)
+            valid_ids[valid++] = k;
+    }
+
+    if (valid == 0)
+    {
+        free(valid_ids);
+        return;
+    }
+
+    unsigned int seed = 1;
+    int *sample = malloc(valid * sizeof(int));
+    int wanted_lists = (int)sqrtf((float)valid);
+    wanted_lists = wanted_lists > 0 ? wanted_lists : 1;
+
+    // coarse lists
+    int sample_count = sample_ids(valid_ids, valid, wanted_lists * IVF_TRAIN_SAMPLES, sample, &seed);
+    float *points = malloc((size_t)sample_count * dim * sizeof(float));
+    for (int p = 0; p < sample_count; p++)
+    {
+        for (int d = 0; d < dim; d++)
+            points[(size_t)p * dim + d] = descriptors[(size_t)sample[p] * dim + d];
+    }
+    index->centroids = malloc((size_t)wanted_lists * dim * sizeof(float));
+    index->list_count = train_kmeans(type, assign_descriptors, points, sample_count, dim,
+                                     index->centroids, wanted_lists, &seed);
+    build_vp_tree(&index->centroid_tree, type, index->centroids, index->list_count);
+    free(points);
+
+    // one codebook per quadrant
+    index->codebooks = calloc((size_t)IVF_SUBSPACES * IVF_CODEBOOK_SIZE * sub_dim, sizeof(float));
+    sample_count = sample_ids(valid_ids, valid, IVF_CODEBOOK_SIZE * IVF_TRAIN_SAMPLES, sample, &seed);
+    points = malloc((size_t)sample_count * sub_dim * sizeof(float));
+    for (int q = 0; q < IVF_SUBSPACES; q++)
+    {
+        for (int p = 0; p < sample_count; p++)
+            get_subvector(descriptors + (size_t)sample[p] * dim, q, sub_dim, points + (size_t)p * sub_dim);
+        float *codebook = index->codebooks + (size_t)q * IVF_CODEBOOK_SIZE * sub_dim;
+        index->codebook_size = train_kmeans(type, assign_subvectors, points, sample_count, sub_dim,
+                                            codebook, IVF_CODEBOOK_SIZE, &seed);
+        if (sub_dim == 1)
+            qsort(codebook, index->codebook_size, sizeof(float), compare_floats);
+    }
+    free(points);
+    free(sample);
+
+    // nearest list of every photo, in blocks to limit the copies
+    int *list_of = malloc(valid * sizeof(int));
+    int block = IVF_TRAIN_SAMPLES * BATCH_TILE_BLOCK;
+    points = malloc((size_t)block * dim * sizeof(float));
+    for (int begin = 0; begin < valid; begin += block)
+    {
+        int block_count = valid - begin < block ? valid - begin : block;
+        for (int p = 0; p < block_count; p++)
+        {
+            for (int d = 0; d < dim; d++)
+                points[(size_t)p * dim + d] = descriptors[(size_t)valid_ids[begin + p] * dim + d];
+        }
+        assign_descriptors(type, points, block_count, index->centroids, index->list_count, list_of + begin);
+    }
+    free(points);
+
+    // lists as ranges of ids and codes (counting sort by list)
+    index->list_begin = calloc(index->list_count + 1, sizeof(int));
+    for (int v = 0; v < valid; v++)
+        index->list_begin[list_of[v] + 1]++;
+    for (int l = 0; l < index->list_count; l++)
+        index->list_begin[l + 1] += index->list_begin[l];
+
+    int *next = malloc(index->list_count * sizeof(int));
+    for (int l = 0; l < index->list_count; l++)
+        next[l] = index->list_begin[l];
+    index->ids = malloc(valid * sizeof(int));
+    index->codes = malloc((size_t)valid * IVF_SUBSPACES);
+    for (int v = 0; v < valid; v++)
+    {
+        int position = next[list_of[v]]++;
+        const float *descriptor = descriptors + (size_t)valid_ids[v] * dim;
+        index->ids[position] = valid_ids[v];
+        for (int q = 0; q < IVF_SUBSPACES; q++)
+        {
+            float subvector[3];
+            get_subvector(descriptor, q, sub_dim, subvector);
+            index->codes[(size_t)position * IVF_SUBSPACES + q] = (uint8_t)nearest_code(
+                type, subvector, index->codebooks + (size_t)q * IVF_CODEBOOK_SIZE * sub_dim,
+                index->codebook_size, sub_dim);
+        }
+    }
+    index->count = valid;
+
+    free(next);
+    free(list_of);
+    free(valid_ids);
+}
+
+int ivf_nearest(ivf_index_t *index, const float *descriptor, int k, int *ids, float *distances,
+                const exclusion_t *exclusion)
+{
+    if (index->count == 0 || k <= 0)
+        return 0;
+
+    int probes = index->probes;
+    if (probes > index->list_count)
+        probes = index->list_count;
+    if (probes > IVF_MAX_PROBES)
+        probes = IVF_MAX_PROBES;
+    int lists[IVF_MAX_PROBES];
+    float list_distances[IVF_MAX_PROBES];
+    probes = vp_tree_nearest(&index->centroid_tree, descriptor, probes, lists, list_distances, NULL);
+
+    // distance of every query quadrant to every code
+    int sub_dim = index->dim / IVF_SUBSPACES;
+    float table[IVF_SUBSPACES * IVF_CODEBOOK_SIZE];
+    for (int q = 0; q < IVF_SUBSPACES; q++)
+    {
+        float subvector[3];
+        get_subvector(descriptor, q, sub_dim, subvector);
+        for (int c = 0; c < index->codebook_size; c++)
+            table[q * IVF_CODEBOOK_SIZE + c] = sqrtf(subspace_difference(
+                index->type, subvector,
+                index->codebooks + ((size_t)q * IVF_CODEBOOK_SIZE + c) * sub_dim));
+    }
+
+    // on the stack unless k is unusually large
+    int shortlist_size = k * IVF_SHORTLIST > IVF_MIN_SHORTLIST ? k * IVF_SHORTLIST : IVF_MIN_SHORTLIST;
+    int shortlist_ids[IVF_MAX_STACK_SHORTLIST];
+    float shortlist_distances[IVF_MAX_STACK_SHORTLIST];
+    bool on_heap = shortlist_size > IVF_MAX_STACK_SHORTLIST;
+    knn_t shortlist = {shortlist_size, 0, shortlist_ids, shortlist_distances};
+    if (on_heap)
+    {
+        shortlist.ids = malloc(shortlist_size * sizeof(int));
+        shortlist.distances = malloc(shortlist_size * sizeof(float));
+    }
+    for (int p = 0; p < probes; p++)
+    {
+        float worst = knn_worst(&shortlist);
+        for (int position = index->list_begin[lists[p]]; position < index->list_begin[lists[p] + 1]; position++)
+        {
+            const uint8_t *code = index->codes + (size_t)position * IVF_SUBSPACES;
+            float d = table[code[0]] + table[IVF_CODEBOOK_SIZE + code[1]] +
+                      table[2 * IVF_CODEBOOK_SIZE + code[2]] + table[3 * IVF_CODEBOOK_SIZE + code[3]];
+            if (d <= worst && !is_excluded(exclusion, index->ids[position]))
+            {
+                knn_insert(&shortlist, index->ids[position], d);
+                worst = knn_worst(&shortlist);
+            }
+        }
+    }
+
+    knn_t result = {k, 0, ids, distances};
+    for (int s = 0; s < shortlist.found; s++)
+    {
+        int id = shortlist.ids[s];
+        knn_insert(&result, id, get_descriptor_difference(index->type, descriptor,
+                                                          index->descriptors + (size_t)id * index->dim));
+    }
+
+    if (on_heap)
+    {
+        free(shortlist.ids);
+        free(shortlist.distances);
+    }
+    return result.found;
+}
+
+void free_ivf_index(ivf_index_t *index)
+{
+    free(index->centroids);
+    free_vp_tree(&index->centroid_tree);
+    free(index->list_begin);
+    free(index->ids);
+    free(index->codes);
+    free(index->codebooks);
+    *index = ivf_index_default;
+}
+
+candidate_list_t alloc_candidate_list(int k, int count)
+{
+    candidate_list_t candidates = {k, count, NULL, NULL, NULL};
+    candidates.ids = malloc((size_t)k * count * sizeof(int));
+    candidates.distances = malloc((size_t)k * count * sizeof(float));
+    candidates.found = calloc(count, sizeof(int));
+    return candidates;
+}
+
+void free_candidate_list(candidate_list_t *candidates)
+{
+    free(candidates->ids);
+    free(candidates->distances);
+    free(candidates->found);
+    candidates->ids = NULL;
+    candidates->distances = NULL;
+    candidates->found = NULL;
+}
+
+/* Library */
+
+void build_tile_indexes(tile_library_t *library, multi_options_t options)
+{
+    library->kd_tree = kd_tree_default;
+    library->vp_tree = vp_tree_default;
+    library->batch_index = batch_index_default;
+    library->ivf_index = ivf_index_default;
+
+    build_luminance_index(&library->luminance_index, library->luminance, library->count);
+    build_shape_scan(&library->shape_scan, library->structure, library->count);
+
+    if (options.matcher == MATCHER_BATCH)
+    {
+        if (options.mode_color)
+            build_batch_index(&library->batch_index, DESCRIPTOR_COLOR, (const float *)library->color, library->count);
+        else
+            build_batch_index(&library->batch_index, DESCRIPTOR_SHAPE, (const float *)library->structure, library->count);
+    }
+
+    if (options.matcher == MATCHER_IVF)
+    {
+        if (options.mode_color)
+            build_ivf_index(&library->ivf_index, DESCRIPTOR_COLOR, (const float *)library->color, library->count, options.probes);
+        else
+            build_ivf_index(&library->ivf_index, DESCRIPTOR_SHAPE, (const float *)library->structure, library->count, options.probes);
+    }
+
+    if (options.matcher == MATCHER_KD_TREE && !options.mode_color)
+    {
+        build_kd_tree(&library->kd_tree, library->structure, library->count);
+    }
+    else if (options.matcher == MATCHER_KD_TREE || options.matcher == MATCHER_VP_TREE)
+    {
+        if (options.mode_color)
+            build_vp_tree(&library->vp_tree, DESCRIPTOR_COLOR, (const float *)library->color, library->count);
+        else
+            build_vp_tree(&library->vp_tree, DESCRIPTOR_SHAPE, (const float *)library->structure, library->count);
+    }
+}
+
+void free_tile_indexes(tile_library_t *library)
+{
+    free_kd_tree(&library->kd_tree);
+    free_vp_tree(&library->vp_tree);
+    free_batch_index(&library->batch_index);
+    free_ivf_index(&library->ivf_index);
+    free_luminance_index(&library->luminance_index);
+    free_shape_scan(&library->shape_scan);
+}
@@ -0,0 +1,774 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "collage.h"
+
+/*
+ * Baseline JPEG encoder as a row sink: rows are collected to a row of MCUs
+ * (16 rows with 4:2:0 subsampling, 8 rows without) that is encoded as soon
+ * as it is complete, so the raster never has to be in memory. Tables,
+ * colour conversion and DCT follow stb_image_write, on one thread the
+ * output is the same as stbi_write_jpg.
+ *
+ * With more threads every row of MCUs is a restart interval: the rows of
+ * MCUs of a band are entropy coded in parallel into segments with their own
+ * DC predictions, written in order with RSTn markers in between.
+ */
+
+static const uint8_t JPEG_ZIGZAG[64] = {
+    0, 1, 5, 6, 14, 15, 27, 28, 2, 4, 7, 13, 16, 26, 29, 42,
+    3, 8, 12, 17, 25, 30, 41, 43, 9, 11, 18, 24, 31, 40, 44, 53,
+    10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60,
+    21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63};
+
+static const int JPEG_DEFAULT_QUALITY = 90;
+static const int JPEG_SUBSAMPLE_QUALITY = 90; // 4:2:0 up to this quality, 4:4:4 above
+
+// quantisation tables of the JPEG standard (Annex K), in row order
+static const int JPEG_LUMINANCE_QUANT[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99};
+static const int JPEG_CHROMINANCE_QUANT[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99};
+
+// scale factors of the AAN DCT
+static const float JPEG_AAN_SCALE[8] = {
+    1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f,
+    1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f};
+
+// Huffman tables of the JPEG standard: codes per length 1-16, then the symbols
+static const uint8_t JPEG_DC_LUMINANCE_COUNTS[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t JPEG_DC_LUMINANCE_SYMBOLS[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+static const uint8_t JPEG_AC_LUMINANCE_COUNTS[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const uint8_t JPEG_AC_LUMINANCE_SYMBOLS[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa};
+static const uint8_t JPEG_DC_CHROMINANCE_COUNTS[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+static const uint8_t JPEG_DC_CHROMINANCE_SYMBOLS[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+static const uint8_t JPEG_AC_CHROMINANCE_COUNTS[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+static const uint8_t JPEG_AC_CHROMINANCE_SYMBOLS[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa};
+
+// code and length in bits of every symbol
+typedef struct
+{
+    uint16_t code[256];
+    uint8_t bits[256];
+} huffman_table_t;
+
+// entropy coded rows of MCUs, with the state of the coder
+typedef struct
+{
+    uint8_t *data;
+    size_t size, capacity;
+    uint32_t bit_buffer;
+    int bit_count;
+    int dc_y, dc_u, dc_v;
+} jpeg_segment_t;
+
+// rows of MCUs to be encoded, image rows of every row of MCUs and how many are valid
+typedef struct
+{
+    const uint8_t *rows;
+    int count;
+} mcu_row_t;
+
+typedef struct
+{
+    byte_output_t output;
+    output_target_t target;
+    int quality;
+    int w, h, ch;
+    bool subsample;
+    int mcu_rows;       // image rows per row of MCUs, also the width of an MCU
+    int blocks_per_mcu; // luminance blocks, then U and V
+
+    uint8_t quant_luminance[64], quant_chrominance[64]; // zigzag order
+    float scale_luminance[64], scale_chrominance[64];
+    huffman_table_t dc_luminance, ac_luminance, dc_chrominance, ac_chrominance;
+
+    uint8_t *pending; // rows of an incomplete row of MCUs
+    int pending_count, rows_written;
+
+    thread_pool_t *pool; // NULL on one thread, no restart intervals
+    int threads;
+    mcu_row_t *batch;           // rows of MCUs of the current band
+    jpeg_segment_t *segments;   // per row of MCUs of batch, one without pool
+    int batch_capacity;
+    int segments_written;
+} jpeg_encoder_t;
+
+// canonical Huffman codes from the counts per length
+static void build_huffman_table(huffman_table_t *table, const uint8_t counts[16], const uint8_t *symbols)
+{
+    memset(table, 0, sizeof(huffman_table_t));
+    int code = 0, s = 0;
+    for (int length = 1; length <= 16; length++)
+    {
+        for (int i = 0; i < counts[length - 1]; i++, s++, code++)
+        {
+            table->code[symbols[s]] = code;
+            table->bits[symbols[s]] = length;
+        }
+        code <<= 1;
+    }
+}
+
+// width and height of an MCU at quality
+int get_jpeg_mcu_size(int quality)
+{
+    quality = quality != 0 ? quality : JPEG_DEFAULT_QUALITY;
+    return quality <= JPEG_SUBSAMPLE_QUALITY ? 16 : 8;
+}
+
+static void init_jpeg_tables(jpeg_encoder_t *encoder)
+{
+    int quality = encoder->quality != 0 ? encoder->quality : JPEG_DEFAULT_QUALITY;
+    encoder->mcu_rows = get_jpeg_mcu_size(quality);
+    encoder->subsample = encoder->mcu_rows == 16;
+    encoder->blocks_per_mcu = encoder->subsample ? 6 : 3;
+    quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+    for (int i = 0; i < 64; i++)
+    {
+        int y = (JPEG_LUMINANCE_QUANT[i] * quality + 50) / 100;
+        int uv = (JPEG_CHROMINANCE_QUANT[i] * quality + 50) / 100;
+        encoder->quant_luminance[JPEG_ZIGZAG[i]] = y < 1 ? 1 : y > 255 ? 255 : y;
+        encoder->quant_chrominance[JPEG_ZIGZAG[i]] = uv < 1 ? 1 : uv > 255 ? 255 : uv;
+    }
+
+    for (int row = 0, k = 0; row < 8; row++)
+    {
+        for (int col = 0; col < 8; col++, k++)
+        {
+            encoder->scale_luminance[k] =
+                1 / (encoder->quant_luminance[JPEG_ZIGZAG[k]] * JPEG_AAN_SCALE[row] * JPEG_AAN_SCALE[col]);
+            encoder->scale_chrominance[k] =
+                1 / (encoder->quant_chrominance[JPEG_ZIGZAG[k]] * JPEG_AAN_SCALE[row] * JPEG_AAN_SCALE[col]);
+        }
+    }
+
+    build_huffman_table(&encoder->dc_luminance, JPEG_DC_LUMINANCE_COUNTS, JPEG_DC_LUMINANCE_SYMBOLS);
+    build_huffman_table(&encoder->ac_luminance, JPEG_AC_LUMINANCE_COUNTS, JPEG_AC_LUMINANCE_SYMBOLS);
+    build_huffman_table(&encoder->dc_chrominance, JPEG_DC_CHROMINANCE_COUNTS, JPEG_DC_CHROMINANCE_SYMBOLS);
+    build_huffman_table(&encoder->ac_chrominance, JPEG_AC_CHROMINANCE_COUNTS, JPEG_AC_CHROMINANCE_SYMBOLS);
+}
+
+// JFIF header, quantisation and Huffman tables, frame and scan header
+static void write_jpeg_headers(jpeg_encoder_t *encoder)
+{
+    static const uint8_t jfif[] = {
+        0xFF, 0xD8, 0xFF, 0xE0, 0, 0x10, 'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0,
+        0xFF, 0xDB, 0, 0x84};
+    static const uint8_t scan[] = {0xFF, 0xDA, 0, 0xC, 3, 1, 0, 2, 0x11, 3, 0x11, 0, 0x3F, 0};
+    const uint8_t frame[] = {
+        0xFF, 0xC0, 0, 0x11, 8, encoder->h >> 8, encoder->h & 0xFF, encoder->w >> 8, encoder->w & 0xFF,
+        3, 1, encoder->subsample ? 0x22 : 0x11, 0, 2, 0x11, 1, 3, 0x11, 1,
+        0xFF, 0xC4, 0x01, 0xA2};
+    byte_output_t *out = &encoder->output;
+
+    write_bytes(out, jfif, sizeof(jfif));
+    put_byte(out, 0);
+    write_bytes(out, encoder->quant_luminance, 64);
+    put_byte(out, 1);
+    write_bytes(out, encoder->quant_chrominance, 64);
+    write_bytes(out, frame, sizeof(frame));
+
+    put_byte(out, 0x00);
+    write_bytes(out, JPEG_DC_LUMINANCE_COUNTS, 16);
+    write_bytes(out, JPEG_DC_LUMINANCE_SYMBOLS, sizeof(JPEG_DC_LUMINANCE_SYMBOLS));
+    put_byte(out, 0x10);
+    write_bytes(out, JPEG_AC_LUMINANCE_COUNTS, 16);
+    write_bytes(out, JPEG_AC_LUMINANCE_SYMBOLS, sizeof(JPEG_AC_LUMINANCE_SYMBOLS));
+    put_byte(out, 0x01);
+    write_bytes(out, JPEG_DC_CHROMINANCE_COUNTS, 16);
+    write_bytes(out, JPEG_DC_CHROMINANCE_SYMBOLS, sizeof(JPEG_DC_CHROMINANCE_SYMBOLS));
+    put_byte(out, 0x11);
+    write_bytes(out, JPEG_AC_CHROMINANCE_COUNTS, 16);
+    write_bytes(out, JPEG_AC_CHROMINANCE_SYMBOLS, sizeof(JPEG_AC_CHROMINANCE_SYMBOLS));
+
+    if (encoder->pool != NULL)
+    {
+        // restart interval of a row of MCUs
+        int mcu_size = encoder->subsample ? 16 : 8;
+        int interval = (encoder->w + mcu_size - 1) / mcu_size;
+        const uint8_t restart[] = {0xFF, 0xDD, 0, 4, interval >> 8, interval & 0xFF};
+        write_bytes(out, restart, sizeof(restart));
+    }
+
+    write_bytes(out, scan, sizeof(scan));
+}
+
+static void grow_segment(jpeg_segment_t *segment)
+{
+    segment->capacity = segment->capacity > 0 ? segment->capacity * 2 : 4096;
+    segment->data = realloc(segment->data, segment->capacity);
+}
+
+// appends the lowest bits of code, 0xFF bytes are stuffed with a 0
+static inline void write_bits(jpeg_segment_t *segment, uint32_t code, int bits)
+{
+    segment->bit_count += bits;
+    segment->bit_buffer |= code << (24 - segment->bit_count);
+    while (segment->bit_count >= 8)
+    {
+        if (segment->capacity - segment->size < 2)
+            grow_segment(segment);
+        uint8_t byte = (segment->bit_buffer >> 16) & 0xFF;
+        segment->data[segment->size++] = byte;
+        if (byte == 0xFF)
+            segment->data[segment->size++] = 0;
+        segment->bit_buffer <<= 8;
+        segment->bit_count -= 8;
+    }
+}
+
+// pads the last byte of segment with ones
+static void finish_segment(jpeg_segment_t *segment)
+{
+    write_bits(segment, 0x7F, 7);
+    segment->bit_buffer = 0;
+    segment->bit_count = 0;
+}
+
+// magnitude category and bits of a coefficient
+static inline int get_value_bits(int value, uint32_t *code)
+{
+    int magnitude = value < 0 ? -value : value;
+    int bits = 1;
+    while (magnitude >>= 1)
+        bits++;
+    *code = (value < 0 ? value - 1 : value) & ((1 << bits) - 1);
+    return bits;
+}
+
+// AAN forward DCT of 8 values, stride floats apart
+static inline void jpeg_dct(float *d, int stride)
+{
+    float d0 = d[0], d1 = d[stride], d2 = d[2 * stride], d3 = d[3 * stride],
+          d4 = d[4 * stride], d5 = d[5 * stride], d6 = d[6 * stride], d7 = d[7 * stride];
+
+    float tmp0 = d0 + d7, tmp7 = d0 - d7;
+    float tmp1 = d1 + d6, tmp6 = d1 - d6;
+    float tmp2 = d2 + d5, tmp5 = d2 - d5;
+    float tmp3 = d3 + d4, tmp4 = d3 - d4;
+
+    // even part
+    float tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+    float tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+    d[0] = tmp10 + tmp11;
+    d[4 * stride] = tmp10 - tmp11;
+    float z1 = (tmp12 + tmp13) * 0.707106781f;
+    d[2 * stride] = tmp13 + z1;
+    d[6 * stride] = tmp13 - z1;
+
+    // odd part
+    tmp10 = tmp4 + tmp5;
+    tmp11 = tmp5 + tmp6;
+    tmp12 = tmp6 + tmp7;
+    float z5 = (tmp10 - tmp12) * 0.382683433f;
+    float z2 = tmp10 * 0.541196100f + z5;
+    float z4 = tmp12 * 1.306562965f + z5;
+    float z3 = tmp11 * 0.707106781f;
+    float z11 = tmp7 + z3, z13 = tmp7 - z3;
+    d[5 * stride] = z13 + z2;
+    d[3 * stride] = z13 - z2;
+    d[stride] = z11 + z4;
+    d[7 * stride] = z11 - z4;
+}
+
+// transforms and quantises an 8x8 block to coefficients in zigzag order
+static void quantize_block(float *block, int stride, const float *scale, int16_t *coefficients)
+{
+    for (int row = 0; row < 8; row++)
+        jpeg_dct(block + row * stride, 1);
+    for (int col = 0; col < 8; col++)
+        jpeg_dct(block + col, stride);
+
+    for (int y = 0, k = 0; y < 8; y++)
+    {
+        for (int x = 0; x < 8; x++, k++)
+        {
+            float v = block[y * stride + x] * scale[k];
+            coefficients[JPEG_ZIGZAG[k]] = (int)(v < 0 ? v - 0.5f : v + 0.5f);
+        }
+    }
+}
+
+// entropy codes the coefficients of a block, returns its DC
+static int code_block(jpeg_segment_t *segment, const int16_t *coefficients, int dc,
+                      const huffman_table_t *dc_table, const huffman_table_t *ac_table)
+{
+    uint32_t code;
+    int diff = coefficients[0] - dc;
+    if (diff == 0)
+    {
+        write_bits(segment, dc_table->code[0], dc_table->bits[0]);
+    }
+    else
+    {
+        int bits = get_value_bits(diff, &code);
+        write_bits(segment, dc_table->code[bits], dc_table->bits[bits]);
+        write_bits(segment, code, bits);
+    }
+
+    int last = 63;
+    while (last > 0 && coefficients[last] == 0)
+        last--;
+
+    for (int i = 1; i <= last; i++)
+    {
+        int zeros = 0;
+        for (; coefficients[i] == 0; i++)
+            zeros++;
+        for (; zeros >= 16; zeros -= 16)
+            write_bits(segment, ac_table->code[0xF0], ac_table->bits[0xF0]);
+
+        int bits = get_value_bits(coefficients[i], &code);
+        int symbol = (zeros << 4) + bits;
+        write_bits(segment, ac_table->code[symbol], ac_table->bits[symbol]);
+        write_bits(segment, code, bits);
+    }
+    if (last != 63)
+        write_bits(segment, ac_table->code[0], ac_table->bits[0]);
+
+    return coefficients[0];
+}
+
+/*
+ * YCbCr of the size x size pixels at x of rows (w pixels of ch bytes),
+ * rows past count repeat the last row and columns past w the last column.
+ */
+static void get_mcu_pixels(const uint8_t *rows, int w, int ch, int count, int x, int size,
+                           float *Y, float *U, float *V)
+{
+    int green = ch > 2 ? 1 : 0, blue = ch > 2 ? 2 : 0; // grey for 1 or 2 channels
+    size_t stride = (size_t)w * ch;
+
+    for (int row = 0, pos = 0; row < size; row++)
+    {
+        const uint8_t *line = rows + (row < count ? row : count - 1) * stride;
+        for (int col = x; col < x + size; col++, pos++)
+        {
+            const uint8_t *pix = line + (col < w ? col : w - 1) * ch;
+            float r = pix[0], g = pix[green], b = pix[blue];
+            Y[pos] = +0.29900f * r + 0.58700f * g + 0.11400f * b - 128;
+            U[pos] = -0.16874f * r - 0.33126f * g + 0.50000f * b;
+            V[pos] = +0.50000f * r - 0.41869f * g - 0.08131f * b;
+        }
+    }
+}
+
+// quantised blocks of the MCU at x of rows: the luminance blocks, then U and V
+static void quantize_mcu(const jpeg_encoder_t *encoder, const uint8_t *rows, int w, int ch, int count, int x,
+                         int16_t *blocks)
+{
+    const float *scale_y = encoder->scale_luminance, *scale_uv = encoder->scale_chrominance;
+
+    if (encoder->subsample)
+    {
+        float Y[256], U[256], V[256], sub_u[64], sub_v[64];
+        get_mcu_pixels(rows, w, ch, count, x, 16, Y, U, V);
+
+        quantize_block(Y, 16, scale_y, blocks);
+        quantize_block(Y + 8, 16, scale_y, blocks + 64);
+        quantize_block(Y + 128, 16, scale_y, blocks + 128);
+        quantize_block(Y + 136, 16, scale_y, blocks + 192);
+
+        for (int row = 0, pos = 0; row < 8; row++)
+        {
+            for (int col = 0; col < 8; col++, pos++)
+            {
+                int j = row * 32 + col * 2;
+                sub_u[pos] = (U[j] + U[j + 1] + U[j + 16] + U[j + 17]) * 0.25f;
+                sub_v[pos] = (V[j] + V[j + 1] + V[j + 16] + V[j + 17]) * 0.25f;
+            }
+        }
+        quantize_block(sub_u, 8, scale_uv, blocks + 256);
+        quantize_block(sub_v, 8, scale_uv, blocks + 320);
+    }
+    else
+    {
+        float Y[64], U[64], V[64];
+        get_mcu_pixels(rows, w, ch, count, x, 8, Y, U, V);
+
+        quantize_block(Y, 8, scale_y, blocks);
+        quantize_block(U, 8, scale_uv, blocks + 64);
+        quantize_block(V, 8, scale_uv, blocks + 128);
+    }
+}
+
+// entropy codes the blocks of an MCU to segment
+static void code_mcu(const jpeg_encoder_t *encoder, jpeg_segment_t *segment, const int16_t *blocks)
+{
+    int luminance_blocks = encoder->blocks_per_mcu - 2;
+    for (int b = 0; b < luminance_blocks; b++, blocks += 64)
+        segment->dc_y = code_block(segment, blocks, segment->dc_y, &encoder->dc_luminance, &encoder->ac_luminance);
+    segment->dc_u = code_block(segment, blocks, segment->dc_u, &encoder->dc_chrominance, &encoder->ac_chrominance);
+    segment->dc_v = code_block(segment, blocks + 64, segment->dc_v, &encoder->dc_chrominance, &encoder->ac_chrominance);
+}
+
+// encodes a row of MCUs from count (at most mcu_rows) rows to segment
+static void encode_mcu_row(const jpeg_encoder_t *encoder, jpeg_segment_t *segment, const uint8_t *rows, int count)
+{
+    int16_t blocks[6 * 64];
+    for (int x = 0; x < encoder->w; x += encoder->mcu_rows)
+    {
+        quantize_mcu(encoder, rows, encoder->w, encoder->ch, count, x, blocks);
+        code_mcu(encoder, segment, blocks);
+    }
+}
+
+// codes row of MCUs k of a batch to segment
+typedef void (*code_row_t)(const jpeg_encoder_t *encoder, jpeg_segment_t *segment, int k, void *arg);
+
+typedef struct
+{
+    jpeg_encoder_t *encoder;
+    code_row_t code;
+    void *arg;
+} interval_job_t;
+
+// restart interval k, coded from a reset state
+static void code_restart_interval(int k, void *arg)
+{
+    interval_job_t *job = arg;
+    jpeg_segment_t *segment = &job->encoder->segments[k];
+    segment->size = 0;
+    segment->dc_y = segment->dc_u = segment->dc_v = 0;
+    job->code(job->encoder, segment, k, job->arg);
+    finish_segment(segment);
+}
+
+// codes and writes count rows of MCUs, in parallel with a pool
+static void code_rows(jpeg_encoder_t *encoder, int count, code_row_t code, void *arg)
+{
+    if (encoder->pool == NULL)
+    {
+        // one interval, the coder state carries over from row to row
+        jpeg_segment_t *segment = &encoder->segments[0];
+        for (int k = 0; k < count; k++)
+        {
+            code(encoder, segment, k, arg);
+            write_bytes(&encoder->output, segment->data, segment->size);
+            segment->size = 0;
+        }
+        return;
+    }
+
+    interval_job_t job = {encoder, code, arg};
+    thread_pool_run(encoder->pool, count, code_restart_interval, &job);
+    for (int k = 0; k < count; k++, encoder->segments_written++)
+    {
+        if (encoder->segments_written > 0)
+        {
+            put_byte(&encoder->output, 0xFF);
+            put_byte(&encoder->output, 0xD0 + (encoder->segments_written - 1) % 8);
+        }
+        write_bytes(&encoder->output, encoder->segments[k].data, encoder->segments[k].size);
+    }
+}
+
+static void code_batch_row(const jpeg_encoder_t *encoder, jpeg_segment_t *segment, int k, void *arg)
+{
+    encode_mcu_row(encoder, segment, encoder->batch[k].rows, encoder->batch[k].count);
+}
+
+// encodes and writes count rows of MCUs of the batch
+static void encode_batch(jpeg_encoder_t *encoder, int count)
+{
+    code_rows(encoder, count, code_batch_row, NULL);
+    for (int k = 0; k < count; k++)
+        encoder->rows_written += encoder->batch[k].count;
+}
+
+// room for count rows of MCUs in the batch
+static void reserve_batch(jpeg_encoder_t *encoder, int count)
+{
+    if (count <= encoder->batch_capacity)
+        return;
+
+    encoder->batch = realloc(encoder->batch, count * sizeof(mcu_row_t));
+    if (encoder->pool != NULL || encoder->batch_capacity == 0)
+    {
+        int segments = encoder->pool != NULL ? count : 1;
+        int old = encoder->pool != NULL ? encoder->batch_capacity : 0;
+        encoder->segments = realloc(encoder->segments, segments * sizeof(jpeg_segment_t));
+        memset(encoder->segments + old, 0, (segments - old) * sizeof(jpeg_segment_t));
+    }
+    encoder->batch_capacity = count;
+}
+
+static bool jpeg_sink_begin(row_sink_t *sink, int w, int h, int ch)
+{
+    jpeg_encoder_t *encoder = sink->state;
+    if (w <= 0 || h <= 0 || w > 0xFFFF || h > 0xFFFF || ch < 1 || ch > 4)
+    {
+        fprintf(stderr, "ERR: no jpeg of %dx%d pixels with %d channels\n", w, h, ch);
+        return false;
+    }
+
+    encoder->w = w;
+    encoder->h = h;
+    encoder->ch = ch;
+    init_jpeg_tables(encoder);
+    encoder->pool = thread_pool_create(encoder->threads);
+    if (encoder->pool != NULL && encoder->pool->thread_count == 0)
+    {
+        thread_pool_destroy(encoder->pool);
+        encoder->pool = NULL;
+    }
+    reserve_batch(encoder, 1);
+    encoder->pending = malloc((size_t)encoder->mcu_rows * w * ch);
+    if (encoder->pending == NULL || !open_byte_output(&encoder->output, encoder->target))
+        return false;
+
+    write_jpeg_headers(encoder);
+    return true;
+}
+
+static bool jpeg_sink_write_rows(row_sink_t *sink, const uint8_t *rows, int count)
+{
+    jpeg_encoder_t *encoder = sink->state;
+    size_t stride = (size_t)encoder->w * encoder->ch;
+    if (encoder->rows_written + encoder->pending_count + count > encoder->h)
+        return false;
+
+    // a started row of MCUs is completed first, the others come straight from rows
+    reserve_batch(encoder, count / encoder->mcu_rows + 1);
+    int batch = 0;
+    if (encoder->pending_count > 0)
+    {
+        int take = encoder->mcu_rows - encoder->pending_count;
+        take = take < count ? take : count;
+        memcpy(encoder->pending + encoder->pending_count * stride, rows, take * stride);
+        encoder->pending_count += take;
+        rows += take * stride;
+        count -= take;
+        if (encoder->pending_count < encoder->mcu_rows)
+            return true;
+
+        encoder->batch[batch++] = (mcu_row_t){encoder->pending, encoder->mcu_rows};
+    }
+    for (; count >= encoder->mcu_rows; count -= encoder->mcu_rows)
+    {
+        encoder->batch[batch++] = (mcu_row_t){rows, encoder->mcu_rows};
+        rows += encoder->mcu_rows * stride;
+    }
+
+    encode_batch(encoder, batch);
+    encoder->pending_count = 0;
+    if (count > 0)
+    {
+        memcpy(encoder->pending, rows, count * stride);
+        encoder->pending_count = count;
+    }
+
+    return !encoder->output.failed;
+}
+
+static bool jpeg_sink_end(row_sink_t *sink)
+{
+    jpeg_encoder_t *encoder = sink->state;
+
+    // the last row of MCUs repeats the last image row
+    if (encoder->pending_count > 0)
+    {
+        encoder->batch[0] = (mcu_row_t){encoder->pending, encoder->pending_count};
+        encode_batch(encoder, 1);
+        encoder->pending_count = 0;
+    }
+
+    if (encoder->pool == NULL)
+    {
+        jpeg_segment_t *segment = &encoder->segments[0];
+        finish_segment(segment);
+        write_bytes(&encoder->output, segment->data, segment->size);
+    }
+    put_byte(&encoder->output, 0xFF);
+    put_byte(&encoder->output, 0xD9);
+    bool success = close_byte_output(&encoder->output);
+    if (!success)
+        fprintf(stderr, "ERR: could not write %s\n", encoder->output.name);
+    return success && encoder->rows_written == encoder->h;
+}
+
+static void jpeg_sink_destroy(row_sink_t *sink)
+{
+    jpeg_encoder_t *encoder = sink->state;
+    int segments = encoder->pool != NULL ? encoder->batch_capacity : encoder->batch_capacity > 0;
+    close_byte_output(&encoder->output);
+    thread_pool_destroy(encoder->pool);
+    for (int k = 0; k < segments; k++)
+        free(encoder->segments[k].data);
+    free(encoder->segments);
+    free(encoder->batch);
+    free(encoder->pending);
+    free(encoder);
+    free(sink);
+}
+
+/*
+ * Sink that encodes the rows to a jpeg at target, quality 1-100 (0 = 90).
+ * With threads other than 1 (0 = all cpus) the rows of MCUs are restart
+ * intervals coded in parallel.
+ */
+row_sink_t *create_jpeg_sink(output_target_t target, int quality, int threads)
+{
+    row_sink_t *sink = malloc(sizeof(row_sink_t));
+    jpeg_encoder_t *encoder = calloc(1, sizeof(jpeg_encoder_t));
+    encoder->target = target;
+    encoder->quality = quality;
+    encoder->threads = threads;
+
+    sink->begin = jpeg_sink_begin;
+    sink->write_rows = jpeg_sink_write_rows;
+    sink->end = jpeg_sink_end;
+    sink->destroy = jpeg_sink_destroy;
+    sink->state = encoder;
+    return sink;
+}
+
+/*
+ * DCT domain assembly: if the photos are a multiple of the MCU size, each
+ * MCU of the collage is an MCU of a photo. The quantised blocks of every
+ * used photo are computed once, the collage is then only entropy coded from
+ * them, with the same result as encoding its pixels.
+ */
+
+typedef struct
+{
+    const jpeg_encoder_t *encoder;
+    const selection_grid_t *selection;
+    const tile_library_t *library;
+    int *photos;      // used photos
+    int *block_index; // per photo of the library, index in photos or -1
+    int16_t *blocks;  // per used photo, its MCUs in row order
+    int mcus_w, mcus_h; // MCUs of a photo
+    size_t photo_coefficients;
+    int first_row; // row of MCUs of the batch
+} mosaic_job_t;
+
+static void quantize_photo(int p, void *arg)
+{
+    mosaic_job_t *job = arg;
+    const jpeg_encoder_t *encoder = job->encoder;
+    int size = encoder->mcu_rows, w = job->library->w;
+    const uint8_t *photo = job->library->images[job->photos[p]];
+    int16_t *blocks = job->blocks + p * job->photo_coefficients;
+
+    for (int my = 0; my < job->mcus_h; my++)
+    {
+        const uint8_t *rows = photo + (size_t)my * size * w * encoder->ch;
+        for (int mx = 0; mx < job->mcus_w; mx++, blocks += encoder->blocks_per_mcu * 64)
+            quantize_mcu(encoder, rows, w, encoder->ch, size, mx * size, blocks);
+    }
+}
+
+static void code_mosaic_row(const jpeg_encoder_t *encoder, jpeg_segment_t *segment, int k, void *arg)
+{
+    mosaic_job_t *job = arg;
+    int row = job->first_row + k;
+    int cell_row = row / job->mcus_h, my = row % job->mcus_h;
+    size_t mcu_coefficients = encoder->blocks_per_mcu * 64;
+
+    for (int j = 0; j < job->selection->cols; j++)
+    {
+        int photo = job->selection->photos[cell_row * job->selection->cols + j];
+        const int16_t *blocks = job->blocks + job->block_index[photo] * job->photo_coefficients +
+                                my * job->mcus_w * mcu_coefficients;
+        for (int mx = 0; mx < job->mcus_w; mx++, blocks += mcu_coefficients)
+            code_mcu(encoder, segment, blocks);
+    }
+}
+
+/*
+ * Writes the photos of selection as jpeg to target, assembled from their
+ * quantised blocks. The photos of library have to be a multiple of
+ * get_jpeg_mcu_size(quality) wide and high, with channels channels.
+ */
+bool write_jpeg_mosaic(output_target_t target, int quality, int threads,
+                       const selection_grid_t *selection, const tile_library_t *library, int channels)
+{
+    int mcu_size = get_jpeg_mcu_size(quality);
+    if (library->w % mcu_size != 0 || library->h % mcu_size != 0)
+    {
+        fprintf(stderr, "ERR: photos of %dx%d px are no multiple of the jpeg MCU (%d px)\n",
+                library->w, library->h, mcu_size);
+        return false;
+    }
+
+    row_sink_t *sink = create_jpeg_sink(target, quality, threads);
+    jpeg_encoder_t *encoder = sink->state;
+    if (!sink->begin(sink, selection->cols * library->w, selection->rows * library->h, channels))
+    {
+        free_row_sink(sink);
+        return false;
+    }
+
+    mosaic_job_t job = {encoder, selection, library};
+    job.mcus_w = library->w / mcu_size;
+    job.mcus_h = library->h / mcu_size;
+    job.photo_coefficients = (size_t)job.mcus_w * job.mcus_h * encoder->blocks_per_mcu * 64;
+
+    int used = 0, cells = selection->rows * selection->cols;
+    job.photos = malloc(library->count * sizeof(int));
+    job.block_index = malloc(library->count * sizeof(int));
+    for (int i = 0; i < library->count; i++)
+        job.block_index[i] = -1;
+    for (int c = 0; c < cells; c++)
+    {
+        int photo = selection->photos[c];
+        if (job.block_index[photo] < 0)
+        {
+            job.block_index[photo] = used;
+            job.photos[used++] = photo;
+        }
+    }
+    job.blocks = malloc(used * job.photo_coefficients * sizeof(int16_t));
+
+    if (encoder->pool != NULL)
+        thread_pool_run(encoder->pool, used, quantize_photo, &job);
+    else
+        for (int p = 0; p < used; p++)
+            quantize_photo(p, &job);
+
+    // a row of photos per batch
+    reserve_batch(encoder, job.mcus_h);
+    for (job.first_row = 0; job.first_row < selection->rows * job.mcus_h; job.first_row += job.mcus_h)
+        code_rows(encoder, job.mcus_h, code_mosaic_row, &job);
+    encoder->rows_written = encoder->h;
+
+    bool success = sink->end(sink);
+    free(job.photos);
+    free(job.block_index);
+    free(job.blocks);
+    free_row_sink(sink);
+    return success;
+}
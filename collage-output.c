@@ -0,0 +1,621 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "collage.h"
+
+/*
+ * Row sinks, the consumers of streamed collages.
+ */
+
+void free_row_sink(row_sink_t *sink)
+{
+    if (sink != NULL)
+        sink->destroy(sink);
+}
+
+/* Image sink */
+
+// collects the rows in an image, for callers that need the whole raster
+typedef struct
+{
+    image_t *image;
+    size_t written; // bytes
+} image_sink_t;
+
+static bool image_sink_begin(row_sink_t *sink, int w, int h, int ch)
+{
+    image_sink_t *state = sink->state;
+    image_t image = {NULL, w, h, ch};
+    image.pix = malloc(get_image_size(image));
+    *state->image = image;
+    state->written = 0;
+    return image.pix != NULL;
+}
+
+static bool image_sink_write_rows(row_sink_t *sink, const uint8_t *rows, int count)
+{
+    image_sink_t *state = sink->state;
+    image_t *image = state->image;
+    size_t bytes = (size_t)count * image->w * image->ch;
+    if (state->written + bytes > get_image_size(*image))
+        return false;
+
+    memcpy(image->pix + state->written, rows, bytes);
+    state->written += bytes;
+    return true;
+}
+
+static bool image_sink_end(row_sink_t *sink)
+{
+    image_sink_t *state = sink->state;
+    return state->written == get_image_size(*state->image);
+}
+
+static void image_sink_destroy(row_sink_t *sink)
+{
+    free(sink->state);
+    free(sink);
+}
+
+// sink that allocates image on begin, the pixels belong to the caller
+row_sink_t *create_image_sink(image_t *image)
+{
+    row_sink_t *sink = malloc(sizeof(row_sink_t));
+    image_sink_t *state = malloc(sizeof(image_sink_t));
+    state->image = image;
+    state->written = 0;
+    *image = image_default;
+
+    sink->begin = image_sink_begin;
+    sink->write_rows = image_sink_write_rows;
+    sink->end = image_sink_end;
+    sink->destroy = image_sink_destroy;
+    sink->state = state;
+    return sink;
+}
+
+/* Byte output */
+
+static const size_t BYTE_OUTPUT_BUFFER = 1 << 20; // bytes per write to the file
+
+bool open_byte_output(byte_output_t *output, output_target_t target)
+{
+    output->file = NULL;
+    output->close_file = false;
+    output->memory = target.memory;
+    output->used = 0;
+
+    if (target.memory != NULL)
+    {
+        // the bytes go straight to the memory of the caller
+        output->name = "memory";
+        if (target.memory->capacity == 0)
+        {
+            target.memory->data = malloc(BYTE_OUTPUT_BUFFER);
+            target.memory->capacity = target.memory->data != NULL ? BYTE_OUTPUT_BUFFER : 0;
+        }
+        target.memory->size = 0;
+        output->buffer = target.memory->data;
+        output->size = target.memory->capacity;
+        output->failed = output->buffer == NULL;
+        return !output->failed;
+    }
+
+    if (target.stream != NULL)
+    {
+        output->name = target.path != NULL ? target.path : "stream";
+        output->file = target.stream;
+    }
+    else
+    {
+        output->name = target.path;
+        output->file = fopen(target.path, "wb");
+        output->close_file = true;
+        if (output->file == NULL)
+            fprintf(stderr, "ERR: could not open %s\n", target.path);
+    }
+    output->buffer = malloc(BYTE_OUTPUT_BUFFER);
+    output->size = BYTE_OUTPUT_BUFFER;
+    output->failed = output->file == NULL || output->buffer == NULL;
+    if (output->failed)
+        close_byte_output(output);
+    return !output->failed;
+}
+
+// writes the buffer to the file, in memory the buffer grows instead
+bool flush_byte_output(byte_output_t *output)
+{
+    if (output->memory != NULL)
+    {
+        if (output->used < output->size || output->failed)
+            return !output->failed;
+
+        uint8_t *data = realloc(output->memory->data, output->size * 2);
+        if (data == NULL)
+        {
+            output->failed = true;
+            output->used = 0;
+            return false;
+        }
+        output->memory->data = output->buffer = data;
+        output->memory->capacity = output->size = output->size * 2;
+        return true;
+    }
+
+    if (output->used > 0 && !output->failed &&
+        fwrite(output->buffer, 1, output->used, output->file) != output->used)
+        output->failed = true;
+    output->used = 0;
+    return !output->failed;
+}
+
+void write_bytes(byte_output_t *output, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+    while (size > 0)
+    {
+        if (output->used == output->size)
+            flush_byte_output(output);
+        size_t count = output->size - output->used < size ? output->size - output->used : size;
+        memcpy(output->buffer + output->used, bytes, count);
+        output->used += count;
+        bytes += count;
+        size -= count;
+    }
+}
+
+// flushes and closes the file (not a stream), false if any write failed, safe to repeat
+bool close_byte_output(byte_output_t *output)
+{
+    if (output->memory != NULL)
+    {
+        output->memory->size = output->failed ? 0 : output->used;
+        output->memory = NULL;
+        output->buffer = NULL;
+    }
+    if (output->file != NULL)
+    {
+        flush_byte_output(output);
+        if ((output->close_file ? fclose(output->file) : fflush(output->file)) != 0)
+            output->failed = true;
+    }
+    free(output->buffer);
+    output->file = NULL;
+    output->buffer = NULL;
+    output->size = output->used = 0;
+    return !output->failed;
+}
+
+/* Lossless file sinks */
+
+// state of the PPM, QOI and PNG sinks
+typedef struct
+{
+    byte_output_t output;
+    output_target_t target;
+    int w, h, ch;
+    int rows_written;
+
+    // QOI: colours seen, previous pixel and length of its run
+    uint8_t index[64][4];
+    uint8_t previous[4];
+    int run;
+
+    // PNG: IDAT data of the chunk, checksum of the zlib stream and stored blocks
+    uint8_t *chunk;
+    size_t chunk_used;
+    uint32_t adler_a, adler_b;
+    size_t stream_remaining; // uncompressed bytes not yet in a stored block
+    int block_remaining;     // bytes of the current stored block
+} file_sink_t;
+
+static const size_t PNG_CHUNK_SIZE = 1 << 20;   // IDAT data per chunk
+static const int PNG_STORED_BLOCK_SIZE = 65535; // largest stored deflate block
+static const uint32_t ADLER_MODULUS = 65521;
+
+static inline void put_uint32_be(byte_output_t *output, uint32_t value)
+{
+    put_byte(output, value >> 24);
+    put_byte(output, value >> 16);
+    put_byte(output, value >> 8);
+    put_byte(output, value);
+}
+
+static bool file_sink_open(row_sink_t *sink, int w, int h, int ch)
+{
+    file_sink_t *state = sink->state;
+    state->w = w;
+    state->h = h;
+    state->ch = ch;
+    state->rows_written = 0;
+    return open_byte_output(&state->output, state->target);
+}
+
+static bool file_sink_close(row_sink_t *sink)
+{
+    file_sink_t *state = sink->state;
+    bool success = close_byte_output(&state->output);
+    if (!success)
+        fprintf(stderr, "ERR: could not write %s\n", state->output.name);
+    return success && state->rows_written == state->h;
+}
+
+static void file_sink_destroy(row_sink_t *sink)
+{
+    file_sink_t *state = sink->state;
+    close_byte_output(&state->output);
+    free(state->chunk);
+    free(state);
+    free(sink);
+}
+
+static row_sink_t *create_file_sink_of(output_target_t target,
+                                       bool (*begin)(row_sink_t *, int, int, int),
+                                       bool (*write_rows)(row_sink_t *, const uint8_t *, int),
+                                       bool (*end)(row_sink_t *))
+{
+    row_sink_t *sink = malloc(sizeof(row_sink_t));
+    file_sink_t *state = calloc(1, sizeof(file_sink_t));
+    state->target = target;
+
+    sink->begin = begin;
+    sink->write_rows = write_rows;
+    sink->end = end;
+    sink->destroy = file_sink_destroy;
+    sink->state = state;
+    return sink;
+}
+
+/* PPM sink */
+
+// binary PGM (1 channel) or PPM (3 channels), the rows as they are
+static bool ppm_sink_begin(row_sink_t *sink, int w, int h, int ch)
+{
+    file_sink_t *state = sink->state;
+    if (ch != 1 && ch != 3)
+    {
+        fprintf(stderr, "ERR: ppm needs 1 or 3 channels, not %d\n", ch);
+        return false;
+    }
+    if (!file_sink_open(sink, w, h, ch))
+        return false;
+
+    char header[64];
+    int length = snprintf(header, sizeof(header), "P%d\n%d %d\n255\n", ch == 1 ? 5 : 6, w, h);
+    write_bytes(&state->output, header, length);
+    return true;
+}
+
+static bool raw_sink_write_rows(row_sink_t *sink, const uint8_t *rows, int count)
+{
+    file_sink_t *state = sink->state;
+    if (state->rows_written + count > state->h)
+        return false;
+
+    write_bytes(&state->output, rows, (size_t)count * state->w * state->ch);
+    state->rows_written += count;
+    return !state->output.failed;
+}
+
+/* QOI sink */
+
+static const uint8_t QOI_OP_INDEX = 0x00;
+static const uint8_t QOI_OP_DIFF = 0x40;
+static const uint8_t QOI_OP_LUMA = 0x80;
+static const uint8_t QOI_OP_RUN = 0xc0;
+static const uint8_t QOI_OP_RGB = 0xfe;
+static const uint8_t QOI_OP_RGBA = 0xff;
+static const int QOI_MAX_RUN = 62;
+
+static bool qoi_sink_begin(row_sink_t *sink, int w, int h, int ch)
+{
+    file_sink_t *state = sink->state;
+    if (ch != 3 && ch != 4)
+    {
+        fprintf(stderr, "ERR: qoi needs 3 or 4 channels, not %d\n", ch);
+        return false;
+    }
+    if (!file_sink_open(sink, w, h, ch))
+        return false;
+
+    memset(state->index, 0, sizeof(state->index));
+    state->previous[0] = state->previous[1] = state->previous[2] = 0;
+    state->previous[3] = 255;
+    state->run = 0;
+
+    write_bytes(&state->output, "qoif", 4);
+    put_uint32_be(&state->output, w);
+    put_uint32_be(&state->output, h);
+    put_byte(&state->output, ch);
+    put_byte(&state->output, 0); // sRGB with linear alpha
+    return true;
+}
+
+// the pixels continue over row ends, a run can span rows
+static bool qoi_sink_write_rows(row_sink_t *sink, const uint8_t *rows, int count)
+{
+    file_sink_t *state = sink->state;
+    byte_output_t *out = &state->output;
+    if (state->rows_written + count > state->h)
+        return false;
+
+    size_t pixels = (size_t)count * state->w;
+    uint8_t *prev = state->previous;
+    for (size_t i = 0; i < pixels; i++, rows += state->ch)
+    {
+        uint8_t px[4] = {rows[0], rows[1], rows[2], state->ch == 4 ? rows[3] : 255};
+        if (memcmp(px, prev, 4) == 0)
+        {
+            if (++state->run == QOI_MAX_RUN)
+            {
+                put_byte(out, QOI_OP_RUN | (state->run - 1));
+                state->run = 0;
+            }
+            continue;
+        }
+        if (state->run > 0)
+        {
+            put_byte(out, QOI_OP_RUN | (state->run - 1));
+            state->run = 0;
+        }
+
+        int hash = (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+        if (memcmp(state->index[hash], px, 4) == 0)
+        {
+            put_byte(out, QOI_OP_INDEX | hash);
+        }
+        else
+        {
+            memcpy(state->index[hash], px, 4);
+            if (px[3] == prev[3])
+            {
+                int8_t dr = px[0] - prev[0], dg = px[1] - prev[1], db = px[2] - prev[2];
+                int8_t dr_dg = dr - dg, db_dg = db - dg;
+                if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2)
+                {
+                    put_byte(out, QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                }
+                else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8)
+                {
+                    put_byte(out, QOI_OP_LUMA | (dg + 32));
+                    put_byte(out, (dr_dg + 8) << 4 | (db_dg + 8));
+                }
+                else
+                {
+                    put_byte(out, QOI_OP_RGB);
+                    write_bytes(out, px, 3);
+                }
+            }
+            else
+            {
+                put_byte(out, QOI_OP_RGBA);
+                write_bytes(out, px, 4);
+            }
+        }
+        memcpy(prev, px, 4);
+    }
+
+    state->rows_written += count;
+    return !out->failed;
+}
+
+static bool qoi_sink_end(row_sink_t *sink)
+{
+    static const uint8_t padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    file_sink_t *state = sink->state;
+    if (state->run > 0)
+        put_byte(&state->output, QOI_OP_RUN | (state->run - 1));
+    write_bytes(&state->output, padding, sizeof(padding));
+    return file_sink_close(sink);
+}
+
+/* PNG sink */
+
+static uint32_t CRC_TABLE[256];
+static pthread_once_t CRC_TABLE_ONCE = PTHREAD_ONCE_INIT;
+
+static void build_crc_table()
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        CRC_TABLE[n] = c;
+    }
+}
+
+static uint32_t update_crc(uint32_t crc, const uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        crc = CRC_TABLE[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+static void write_png_chunk(byte_output_t *output, const char *type, const uint8_t *data, size_t size)
+{
+    put_uint32_be(output, size);
+    write_bytes(output, type, 4);
+    write_bytes(output, data, size);
+    uint32_t crc = update_crc(0xffffffffu, (const uint8_t *)type, 4);
+    put_uint32_be(output, update_crc(crc, data, size) ^ 0xffffffffu);
+}
+
+// appends bytes of the zlib stream, full chunks are written as IDAT
+static void put_png_stream(file_sink_t *state, const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        size_t count = PNG_CHUNK_SIZE - state->chunk_used < size ? PNG_CHUNK_SIZE - state->chunk_used : size;
+        memcpy(state->chunk + state->chunk_used, data, count);
+        state->chunk_used += count;
+        data += count;
+        size -= count;
+        if (state->chunk_used == PNG_CHUNK_SIZE)
+        {
+            write_png_chunk(&state->output, "IDAT", state->chunk, state->chunk_used);
+            state->chunk_used = 0;
+        }
+    }
+}
+
+// appends uncompressed bytes as stored deflate blocks, the last one is final
+static void deflate_png_bytes(file_sink_t *state, const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        if (state->block_remaining == 0)
+        {
+            int length = state->stream_remaining < (size_t)PNG_STORED_BLOCK_SIZE ? state->stream_remaining
+                                                                                  : PNG_STORED_BLOCK_SIZE;
+            state->stream_remaining -= length;
+            uint8_t header[5] = {state->stream_remaining == 0, length & 0xff, length >> 8,
+                                 ~length & 0xff, (~length >> 8) & 0xff};
+            put_png_stream(state, header, sizeof(header));
+            state->block_remaining = length;
+        }
+
+        size_t count = (size_t)state->block_remaining < size ? (size_t)state->block_remaining : size;
+        put_png_stream(state, data, count);
+
+        // Adler-32 in steps that cannot overflow
+        for (size_t i = 0; i < count;)
+        {
+            size_t end = i + 5552 < count ? i + 5552 : count;
+            for (; i < end; i++)
+            {
+                state->adler_a += data[i];
+                state->adler_b += state->adler_a;
+            }
+            state->adler_a %= ADLER_MODULUS;
+            state->adler_b %= ADLER_MODULUS;
+        }
+
+        state->block_remaining -= count;
+        data += count;
+        size -= count;
+    }
+}
+
+// 8 bit grey, grey and alpha, RGB or RGBA without filters and compression
+static bool png_sink_begin(row_sink_t *sink, int w, int h, int ch)
+{
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    static const uint8_t color_types[5] = {0, 0, 4, 2, 6};
+    static const uint8_t zlib_header[2] = {0x78, 0x01};
+    file_sink_t *state = sink->state;
+
+    pthread_once(&CRC_TABLE_ONCE, build_crc_table);
+    state->chunk = malloc(PNG_CHUNK_SIZE);
+    if (state->chunk == NULL || ch < 1 || ch > 4 || !file_sink_open(sink, w, h, ch))
+        return false;
+
+    uint8_t header[13] = {w >> 24, w >> 16, w >> 8, w, h >> 24, h >> 16, h >> 8, h, 8, color_types[ch], 0, 0, 0};
+    write_bytes(&state->output, signature, sizeof(signature));
+    write_png_chunk(&state->output, "IHDR", header, sizeof(header));
+
+    state->chunk_used = 0;
+    state->adler_a = 1;
+    state->adler_b = 0;
+    state->stream_remaining = (size_t)h * ((size_t)w * ch + 1);
+    state->block_remaining = 0;
+    put_png_stream(state, zlib_header, sizeof(zlib_header));
+    return true;
+}
+
+static bool png_sink_write_rows(row_sink_t *sink, const uint8_t *rows, int count)
+{
+    static const uint8_t filter_none = 0;
+    file_sink_t *state = sink->state;
+    size_t stride = (size_t)state->w * state->ch;
+    if (state->rows_written + count > state->h)
+        return false;
+
+    for (int row = 0; row < count; row++)
+    {
+        deflate_png_bytes(state, &filter_none, 1);
+        deflate_png_bytes(state, rows + row * stride, stride);
+    }
+    state->rows_written += count;
+    return !state->output.failed;
+}
+
+static bool png_sink_end(row_sink_t *sink)
+{
+    file_sink_t *state = sink->state;
+    uint8_t adler[4] = {state->adler_b >> 8, state->adler_b, state->adler_a >> 8, state->adler_a};
+    put_png_stream(state, adler, sizeof(adler));
+    write_png_chunk(&state->output, "IDAT", state->chunk, state->chunk_used);
+    write_png_chunk(&state->output, "IEND", NULL, 0);
+    return file_sink_close(sink);
+}
+
+/* Output by file name */
+
+static bool has_extension(const char *path, const char *extension)
+{
+    size_t length = strlen(path), extension_length = strlen(extension);
+    return length >= extension_length && strcasecmp(path + length - extension_length, extension) == 0;
+}
+
+// format of the extension of path, jpeg for all unknown ones
+output_format_t get_output_format(const char *path)
+{
+    if (has_extension(path, ".ppm") || has_extension(path, ".pgm"))
+        return OUTPUT_PPM;
+    if (has_extension(path, ".qoi"))
+        return OUTPUT_QOI;
+    if (has_extension(path, ".png"))
+        return OUTPUT_PNG;
+    if (has_extension(path, ".dzi"))
+        return OUTPUT_DZI;
+    return OUTPUT_JPEG;
+}
+
+// sink encoding to target in format, quality and threads for jpeg (see create_jpeg_sink)
+row_sink_t *create_output_sink(output_target_t target, output_format_t format, int quality, int threads)
+{
+    switch (format)
+    {
+    case OUTPUT_PPM:
+        return create_file_sink_of(target, ppm_sink_begin, raw_sink_write_rows, file_sink_close);
+    case OUTPUT_QOI:
+        return create_file_sink_of(target, qoi_sink_begin, qoi_sink_write_rows, qoi_sink_end);
+    case OUTPUT_PNG:
+        return create_file_sink_of(target, png_sink_begin, png_sink_write_rows, png_sink_end);
+    case OUTPUT_DZI:
+        return create_dzi_sink(target, quality, threads);
+    case OUTPUT_JPEG:
+    default:
+        return create_jpeg_sink(target, quality, threads);
+    }
+}
+
+// sink writing a file at path in the format of its extension
+row_sink_t *create_file_sink(const char *path, int quality, int threads)
+{
+    output_target_t target = {path};
+    return create_output_sink(target, get_output_format(path), quality, threads);
+}
+
+/*
+ * Sink encoding to memory, for embedding without files: after end its data
+ * holds size bytes of the encoded image, grown as needed. The caller keeps
+ * and frees the buffer, it can be reused for the next image.
+ */
+row_sink_t *create_memory_sink(memory_buffer_t *memory, output_format_t format, int quality, int threads)
+{
+    output_target_t target = {NULL, NULL, memory};
+    return create_output_sink(target, format, quality, threads);
+}
+
+// writes image in one band to sink
+bool write_image_to_sink(image_t image, row_sink_t *sink)
+{
+    if (!sink->begin(sink, image.w, image.h, image.ch))
+        return false;
+    bool success = sink->write_rows(sink, image.pix, image.h);
+    return sink->end(sink) && success;
+}
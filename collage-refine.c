@@ -0,0 +1,228 @@
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "collage.h"
+
+/*
+ * Simulated annealing on a finished placement. A proposal swaps the photos
+ * of two cells or replaces the photo of a cell with one of its candidates
+ * and is scored by its local delta only: the distances of the changed
+ * cells, the repetitions inside their no repetition radius and the usage
+ * terms. The collage is split into strips of at least radius rows, every
+ * second strip is refined at the same time (one task with its own random
+ * generator each), so the neighbourhoods of cells in parallel strips never
+ * overlap.
+ */
+
+static const float REFINE_START_TEMPERATURE = 0.05f; // relative to the mean cell cost
+static const float REFINE_END_TEMPERATURE = 0.0001f;
+static const int REFINE_MOVES_PER_CELL = 4;          // per strip task
+static const int REFINE_SWAP_DISTANCE = 8;           // columns between swapped cells
+
+typedef struct
+{
+    int *placement;
+    int rows, cols, radius;
+    descriptor_t type;
+    int dim;
+    const float *cells;  // descriptor of every cell
+    const float *photos; // descriptor of every photo
+    candidate_list_t *candidates;
+
+    int *uses; // per photo or NULL
+    int max_uses;
+    float usage_penalty;
+    float repetition_cost;
+
+    int strip_height, phase, epoch;
+    float temperature;
+    long accepted;
+} refine_t;
+
+static inline float get_cost(refine_t *refine, int cell, int image)
+{
+    return get_descriptor_difference(refine->type, refine->cells + (size_t)cell * refine->dim,
+                                     refine->photos + (size_t)image * refine->dim);
+}
+
+// cells within the radius of cell (besides cell and skip) that show image
+static int count_repetitions(refine_t *refine, int cell, int image, int skip)
+{
+    int i = cell / refine->cols, j = cell % refine->cols, r = refine->radius;
+    int repetitions = 0;
+    for (int k = i - r > 0 ? i - r : 0; k <= i + r && k < refine->rows; k++)
+    {
+        for (int l = j - r > 0 ? j - r : 0; l <= j + r && l < refine->cols; l++)
+        {
+            int other = k * refine->cols + l;
+            if (other != cell && other != skip && refine->placement[other] == image)
+                repetitions++;
+        }
+    }
+    return repetitions;
+}
+
+static inline bool is_fixed(refine_t *refine, int cell)
+{
+    return refine->candidates->found[cell] == 0;
+}
+
+static inline bool accept(refine_t *refine, float delta, unsigned int *seed)
+{
+    return delta <= 0 || (float)rand_r(seed) / RAND_MAX < expf(-delta / refine->temperature);
+}
+
+static void propose_swap(refine_t *refine, int p, unsigned int *seed, int row_begin, int row_end)
+{
+    int i = row_begin + rand_r(seed) % (row_end - row_begin);
+    int j = p % refine->cols + rand_r(seed) % (2 * REFINE_SWAP_DISTANCE + 1) - REFINE_SWAP_DISTANCE;
+    if (j < 0 || j >= refine->cols)
+        return;
+
+    int q = i * refine->cols + j;
+    int a = refine->placement[p], b = refine->placement[q];
+    if (q == p || a == b || is_fixed(refine, q))
+        return;
+
+    float delta = get_cost(refine, p, b) + get_cost(refine, q, a) -
+                  get_cost(refine, p, a) - get_cost(refine, q, b);
+    delta += refine->repetition_cost * (count_repetitions(refine, p, b, q) + count_repetitions(refine, q, a, p) -
+                                        count_repetitions(refine, p, a, q) - count_repetitions(refine, q, b, p));
+
+    if (accept(refine, delta, seed))
+    {
+        refine->placement[p] = b;
+        refine->placement[q] = a;
+        __atomic_add_fetch(&refine->accepted, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void propose_replacement(refine_t *refine, int p, unsigned int *seed)
+{
+    candidate_list_t *candidates = refine->candidates;
+    int a = refine->placement[p];
+    int b = candidates->ids[(size_t)p * candidates->k + rand_r(seed) % candidates->found[p]];
+    if (a == b)
+        return;
+
+    float delta = get_cost(refine, p, b) - get_cost(refine, p, a);
+    delta += refine->repetition_cost * (count_repetitions(refine, p, b, -1) - count_repetitions(refine, p, a, -1));
+
+    if (refine->uses != NULL)
+    {
+        int uses_a = __atomic_load_n(&refine->uses[a], __ATOMIC_RELAXED),
+            uses_b = __atomic_load_n(&refine->uses[b], __ATOMIC_RELAXED);
+        if (refine->max_uses > 0 && uses_b >= refine->max_uses)
+            return;
+        delta += refine->usage_penalty * (uses_b - (uses_a - 1));
+    }
+
+    if (!accept(refine, delta, seed))
+        return;
+
+    if (refine->uses != NULL)
+    {
+        // other strips may have taken the last use meanwhile
+        if (__atomic_add_fetch(&refine->uses[b], 1, __ATOMIC_RELAXED) > refine->max_uses && refine->max_uses > 0)
+        {
+            __atomic_sub_fetch(&refine->uses[b], 1, __ATOMIC_RELAXED);
+            return;
+        }
+        __atomic_sub_fetch(&refine->uses[a], 1, __ATOMIC_RELAXED);
+    }
+    refine->placement[p] = b;
+    __atomic_add_fetch(&refine->accepted, 1, __ATOMIC_RELAXED);
+}
+
+static void refine_strip(int task, void *arg)
+{
+    refine_t *refine = arg;
+    int strip = 2 * task + refine->phase;
+    int row_begin = strip * refine->strip_height,
+        row_end = row_begin + refine->strip_height < refine->rows ? row_begin + refine->strip_height : refine->rows;
+    int cells = (row_end - row_begin) * refine->cols;
+
+    unsigned int seed = (unsigned int)(refine->epoch * 2654435761u) ^ (unsigned int)(strip * 40503u + 1);
+    for (int m = 0; m < cells * REFINE_MOVES_PER_CELL; m++)
+    {
+        int p = row_begin * refine->cols + rand_r(&seed) % cells;
+        if (is_fixed(refine, p))
+            continue;
+
+        if (rand_r(&seed) & 1)
+            propose_swap(refine, p, &seed, row_begin, row_end);
+        else
+            propose_replacement(refine, p, &seed);
+    }
+}
+
+static double get_seconds()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static double get_total_cost(refine_t *refine)
+{
+    double cost = 0;
+    for (int cell = 0; cell < refine->rows * refine->cols; cell++)
+    {
+        if (is_fixed(refine, cell))
+            continue;
+        cost += get_cost(refine, cell, refine->placement[cell]);
+        cost += refine->repetition_cost * count_repetitions(refine, cell, refine->placement[cell], -1) / 2;
+    }
+    return cost;
+}
+
+/*
+ * Refines placement (rows * cols photos) for seconds and returns the number
+ * of accepted proposals. cell_descriptors are of the options descriptor
+ * type, cells without candidates stay as they are. uses (or NULL) is
+ * updated with the replacements.
+ */
+long refine_placement(int *placement, int rows, int cols, const float *cell_descriptors,
+                      tile_library_t *library, multi_options_t *options,
+                      candidate_list_t *candidates, int *uses, double seconds,
+                      thread_pool_t *pool)
+{
+    refine_t refine = {placement, rows, cols, options->radius};
+    refine.type = options->mode_color ? DESCRIPTOR_COLOR : DESCRIPTOR_SHAPE;
+    refine.dim = get_descriptor_dimension(refine.type);
+    refine.cells = cell_descriptors;
+    refine.photos = options->mode_color ? (const float *)library->color : (const float *)library->structure;
+    refine.candidates = candidates;
+    refine.uses = uses;
+    refine.max_uses = options->max_uses;
+
+    // a repetition costs as much as the worst possible match
+    float scale = options->mode_color ? COLOR_DISTANCE_SCALE : 1;
+    refine.repetition_cost = 4 * scale;
+    refine.usage_penalty = options->usage_penalty * scale;
+    refine.strip_height = options->radius > 0 ? options->radius : 1;
+
+    int strips = (rows + refine.strip_height - 1) / refine.strip_height;
+    double start_cost = get_total_cost(&refine);
+    float start_temperature = REFINE_START_TEMPERATURE * start_cost / (rows * cols > 0 ? rows * cols : 1);
+
+    double start = get_seconds(), elapsed = 0;
+    for (refine.epoch = 0; elapsed < seconds && start_temperature > 0; refine.epoch++)
+    {
+        refine.temperature = start_temperature * powf(REFINE_END_TEMPERATURE / REFINE_START_TEMPERATURE,
+                                                      elapsed / seconds);
+        for (refine.phase = 0; refine.phase < 2; refine.phase++)
+        {
+            int tasks = (strips - refine.phase + 1) / 2;
+            if (pool != NULL)
+                thread_pool_run(pool, tasks, refine_strip, &refine);
+            else
+                for (int task = 0; task < tasks; task++)
+                    refine_strip(task, &refine);
+        }
+        elapsed = get_seconds() - start;
+    }
+
+    return refine.accepted;
+}
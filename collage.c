@@ -2,6 +2,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 
 #include "collage.h"
@@ -9,6 +10,12 @@
 static bool DEBUG = false;
 unsigned long TOTAL_MALLOC = 0;
 
+static const int USAGE_CANDIDATES = 16;       // first top-k of the usage aware matcher
+static const float MATCH_CACHE_MARGIN = 1e-4f; // relative
+static const int ABOVE_RANDOM_PROBES = 8;      // random picks before a scan
+static const int COARSE_SHORTLIST = 64;        // default shortlist of MATCHER_COARSE
+static const int GLOBAL_CANDIDATES = 32;       // top-k of -g beyond the exclusion window
+
 /* Helper methods */
 
 void set_debug(bool debug)
@@ -16,16 +23,6 @@ void set_debug(bool debug)
     DEBUG = debug;
 }
 
-bool int_array_contains(int *array, int size, int item)
-{
-    for (int i = 0; i < size; i++)
-    {
-        if (array[i] == item)
-            return true;
-    }
-    return false;
-}
-
 /* Pixel manipulation */
 
 void copy_pixel(uint8_t *image_to, uint8_t *image_from, int channels)
@@ -148,8 +145,7 @@ image_shape_t get_image_shape(image_t image)
 
 float get_shape_difference(image_shape_t s1, image_shape_t s2)
 {
-    return (fabs(s1.y1 - s2.y1) + fabs(s1.y2 - s2.y2) +
-            fabs(s1.y3 - s2.y3) + fabs(s1.y4 - s2.y4));
+    return shape_difference(&s1, &s2);
 }
 
 bool is_default_shape(image_shape_t s)
@@ -160,6 +156,146 @@ bool is_default_shape(image_shape_t s)
             s.y4 == image_shape_default.y4);
 }
 
+/* Colour */
+
+#define LAB_F_TABLE_SIZE 1024
+
+static pthread_once_t LAB_TABLES_ONCE = PTHREAD_ONCE_INIT;
+static float SRGB_TO_LINEAR[256];
+static float LUMINANCE_TABLE[256];
+static float LAB_F_TABLE[LAB_F_TABLE_SIZE + 1];
+
+static void build_lab_tables()
+{
+    for (int i = 0; i < 256; i++)
+    {
+        float v = i / 255.0f;
+        SRGB_TO_LINEAR[i] = v <= 0.04045f ? v / 12.92f : pow((v + 0.055f) / 1.055f, 2.4f);
+        LUMINANCE_TABLE[i] = pow(i / 256.0f, LUMINANCE_POWER_CURVE);
+    }
+
+    // f(t) of the CIELAB definition on [0, 1], interpolated in lab_f
+    const float delta = 6.0f / 29.0f;
+    for (int i = 0; i <= LAB_F_TABLE_SIZE; i++)
+    {
+        float t = i / (float)LAB_F_TABLE_SIZE;
+        LAB_F_TABLE[i] = t > delta * delta * delta ? cbrt(t) : t / (3 * delta * delta) + 4.0f / 29.0f;
+    }
+}
+
+static inline void init_lab_tables()
+{
+    pthread_once(&LAB_TABLES_ONCE, build_lab_tables);
+}
+
+static inline float lab_f(float t)
+{
+    if (t <= 0)
+        return LAB_F_TABLE[0];
+    if (t >= 1)
+        return LAB_F_TABLE[LAB_F_TABLE_SIZE];
+
+    float pos = t * LAB_F_TABLE_SIZE;
+    int i = (int)pos;
+    float w = pos - i;
+    return LAB_F_TABLE[i] + w * (LAB_F_TABLE[i + 1] - LAB_F_TABLE[i]);
+}
+
+// linear sRGB (D65) to CIELAB
+static void linear_to_lab(float r, float g, float b, float *L, float *A, float *B)
+{
+    float fx = lab_f((0.4124564f * r + 0.3575761f * g + 0.1804375f * b) / 0.95047f);
+    float fy = lab_f(0.2126729f * r + 0.7151522f * g + 0.0721750f * b);
+    float fz = lab_f((0.0193339f * r + 0.1191920f * g + 0.9503041f * b) / 1.08883f);
+
+    *L = 116 * fy - 16;
+    *A = 500 * (fx - fy);
+    *B = 200 * (fy - fz);
+}
+
+void get_point_lab(uint8_t r, uint8_t g, uint8_t b, float *L, float *A, float *B)
+{
+    init_lab_tables();
+    linear_to_lab(SRGB_TO_LINEAR[r], SRGB_TO_LINEAR[g], SRGB_TO_LINEAR[b], L, A, B);
+}
+
+/*
+ * Computes average luminance, shape and colour of an image in a single pass.
+ * Each output is optional. Quadrants are the same as in get_image_shape, the
+ * middle column/row of odd sized images is left out.
+ */
+void get_image_descriptors(image_t image, float *luminance, image_shape_t *shape, image_color_t *color)
+{
+    init_lab_tables();
+
+    int half_w = image.w / 2, half_h = image.h / 2;
+    float Y_sum = 0;
+    float brightness[4] = {0}, Y[4] = {0};
+    float red[4] = {0}, green[4] = {0}, blue[4] = {0};
+
+    uint8_t *img_i = image.pix;
+    for (int y = 0; y < image.h; y++)
+    {
+        int row_quadrant = y < half_h ? 0 : (y >= image.h - half_h ? 2 : -1);
+        for (int x = 0; x < image.w; x++, img_i += image.ch)
+        {
+            float Y_point = LUMINANCE_RED * LUMINANCE_TABLE[img_i[0]] +
+                            LUMINANCE_GREEN * LUMINANCE_TABLE[img_i[1]] +
+                            LUMINANCE_BLUE * LUMINANCE_TABLE[img_i[2]];
+            Y_sum += Y_point;
+
+            int col_quadrant = x < half_w ? 0 : (x >= image.w - half_w ? 1 : -1);
+            if (row_quadrant < 0 || col_quadrant < 0)
+                continue;
+
+            int q = row_quadrant + col_quadrant;
+            brightness[q] += img_i[0] + img_i[1] + img_i[2];
+            Y[q] += Y_point;
+            red[q] += SRGB_TO_LINEAR[img_i[0]];
+            green[q] += SRGB_TO_LINEAR[img_i[1]];
+            blue[q] += SRGB_TO_LINEAR[img_i[2]];
+        }
+    }
+
+    float quarter_area = half_w * half_h;
+
+    if (luminance != NULL)
+        *luminance = Y_sum / (image.w * image.h);
+
+    if (shape != NULL)
+    {
+        // first quadrant is brightness like in get_image_shape
+        shape->y1 = brightness[0] / (255 * 3.f) / quarter_area;
+        shape->y2 = Y[1] / quarter_area;
+        shape->y3 = Y[2] / quarter_area;
+        shape->y4 = Y[3] / quarter_area;
+    }
+
+    if (color != NULL)
+    {
+        for (int q = 0; q < 4; q++)
+        {
+            linear_to_lab(red[q] / quarter_area, green[q] / quarter_area, blue[q] / quarter_area,
+                          &color->l[q], &color->a[q], &color->b[q]);
+        }
+    }
+}
+
+float get_color_difference(image_color_t c1, image_color_t c2)
+{
+    return color_difference(&c1, &c2);
+}
+
+bool is_default_color(image_color_t c)
+{
+    for (int q = 0; q < 4; q++)
+    {
+        if (c.l[q] != 0 || c.a[q] != 0 || c.b[q] != 0)
+            return false;
+    }
+    return true;
+}
+
 /* Image analysis */
 
 bool check_image_dimensions(image_t image)
@@ -179,6 +315,127 @@ size_t get_image_size(image_t image)
     return image.w * image.h * image.ch;
 }
 
+/* Exclusion window */
+
+// cells in the exclusion window of a cell away from the collage border
+int get_exclusion_window_size(int radius)
+{
+    return radius * (2 * radius + 1) + radius;
+}
+
+/*
+ * Largest radius whose window takes at most a quarter of the photos, so
+ * every cell keeps enough candidates. Limited by the collage grid.
+ */
+int get_auto_radius(int image_count, int rows, int cols)
+{
+    int max_radius = rows > cols ? rows : cols;
+    int radius = 1;
+    while (radius < max_radius && get_exclusion_window_size(radius + 1) <= image_count / 4)
+        radius++;
+    return radius;
+}
+
+exclusion_t alloc_exclusion(int image_count, int radius, int ring, int rows, int cols)
+{
+    if (ring < radius + 1)
+        ring = radius + 1;
+
+    exclusion_t exclusion = {radius, rows, cols, ring, NULL, NULL, -1, -1, false};
+    exclusion.selection = malloc((size_t)ring * cols * sizeof(int));
+    exclusion.window_count = calloc(image_count, sizeof(int));
+    for (int c = 0; c < ring * cols; c++)
+        exclusion.selection[c] = -1;
+    return exclusion;
+}
+
+// window with its own counts on the selection of exclusion
+exclusion_t share_exclusion(const exclusion_t *exclusion, int image_count)
+{
+    exclusion_t shared = *exclusion;
+    shared.window_count = calloc(image_count, sizeof(int));
+    shared.i = -1;
+    shared.j = -1;
+    shared.shared = true;
+    return shared;
+}
+
+static inline void exclusion_count(exclusion_t *exclusion, int k, int l, int delta)
+{
+    if (k < 0 || l < 0 || l >= exclusion->cols)
+        return;
+
+    int image = exclusion->selection[(k % exclusion->ring) * exclusion->cols + l];
+    if (image >= 0)
+        exclusion->window_count[image] += delta;
+}
+
+// adds (delta 1) or removes (delta -1) the whole window of cell i, j
+static void exclusion_apply(exclusion_t *exclusion, int i, int j, int delta)
+{
+    int r = exclusion->radius;
+    for (int k = i - r; k < i; k++)
+    {
+        for (int l = j - r; l <= j + r; l++)
+            exclusion_count(exclusion, k, l, delta);
+    }
+    for (int l = j - r; l < j; l++)
+        exclusion_count(exclusion, i, l, delta);
+}
+
+/*
+ * Moves the window to cell i, j. Cells have to be visited in raster order
+ * and placed with exclusion_place. Moving one cell to the right updates
+ * only the two columns and two cells that enter or leave the window.
+ */
+void exclusion_move_to(exclusion_t *exclusion, int i, int j)
+{
+    int r = exclusion->radius;
+
+    if (exclusion->i == i && exclusion->j == j - 1)
+    {
+        for (int k = i - r; k < i; k++)
+        {
+            exclusion_count(exclusion, k, j - 1 - r, -1);
+            exclusion_count(exclusion, k, j + r, 1);
+        }
+        exclusion_count(exclusion, i, j - 1 - r, -1);
+        exclusion_count(exclusion, i, j - 1, 1);
+    }
+    else
+    {
+        if (exclusion->i >= 0)
+            exclusion_apply(exclusion, exclusion->i, exclusion->j, -1);
+        exclusion_apply(exclusion, i, j, 1);
+    }
+
+    exclusion->i = i;
+    exclusion->j = j;
+}
+
+void exclusion_place(exclusion_t *exclusion, int i, int j, int image)
+{
+    exclusion->selection[(i % exclusion->ring) * exclusion->cols + j] = image;
+}
+
+// empties the window while its rows are still in the selection
+void exclusion_clear(exclusion_t *exclusion)
+{
+    if (exclusion->i >= 0)
+        exclusion_apply(exclusion, exclusion->i, exclusion->j, -1);
+    exclusion->i = -1;
+    exclusion->j = -1;
+}
+
+void free_exclusion(exclusion_t *exclusion)
+{
+    if (!exclusion->shared)
+        free(exclusion->selection);
+    free(exclusion->window_count);
+    exclusion->selection = NULL;
+    exclusion->window_count = NULL;
+}
+
 int match_image_by_luminance(float Y, float *images_luminance, int count,
                              int not_allowed_1, int not_allowed_2)
 {
@@ -204,17 +461,17 @@ int match_image_by_luminance(float Y, float *images_luminance, int count,
 
 int match_image_by_shape(
     image_shape_t S, image_shape_t *images_structure, int count,
-    int *not_allowed, int not_allowed_count)
+    const exclusion_t *exclusion)
 {
     int best_image = 0;
     float best_distance = 1000;
     for (int k = 0; k < count; k++)
     {
         if (is_default_shape(images_structure[k]) ||
-            int_array_contains(not_allowed, not_allowed_count, k))
+            is_excluded(exclusion, k))
             continue;
 
-        float d = get_shape_difference(S, images_structure[k]);
+        float d = shape_difference_below(&S, &images_structure[k], best_distance);
 
         if (d < best_distance)
         {
@@ -225,16 +482,84 @@ int match_image_by_shape(
     return best_image;
 }
 
-int match_any_image_above(float Y, float *images_luminance, int count,
-                          int *not_allowed, int not_allowed_size)
+int match_image_by_color(
+    image_color_t C, image_color_t *images_color, int count,
+    const exclusion_t *exclusion)
 {
+    int best_image = 0;
+    float best_distance = INFINITY;
     for (int k = 0; k < count; k++)
     {
-        int r = (int)(random() * ((double)count / RAND_MAX));
-        if (images_luminance[r] >= Y && !int_array_contains(not_allowed, not_allowed_size, k))
-            return r;
+        if (is_default_color(images_color[k]) ||
+            is_excluded(exclusion, k))
+            continue;
+
+        float d = color_difference(&C, &images_color[k]);
+
+        if (d < best_distance)
+        {
+            best_distance = d;
+            best_image = k;
+        }
+    }
+    return best_image;
+}
+
+// uniform in [0, n)
+static inline int random_below(unsigned int *seed, int n)
+{
+    return (int)(rand_r(seed) / ((double)RAND_MAX + 1) * n);
+}
+
+// excluded, or at its cap of max_uses (> 0) uses
+static inline bool is_unavailable(const exclusion_t *exclusion, const int *uses, int max_uses, int k)
+{
+    return is_excluded(exclusion, k) || (uses != NULL && max_uses > 0 && uses[k] >= max_uses);
+}
+
+/*
+ * Random allowed photo with a luminance of at least Y, -1 if there is none.
+ * The photos above Y are a suffix of the sorted index, a few uniform picks
+ * from it find an allowed photo unless most are excluded, then one of the
+ * allowed photos of the suffix is picked, also uniformly. Photos with
+ * max_uses (> 0) uses are not allowed, uses can be NULL.
+ */
+int match_any_image_above(float Y, const luminance_index_t *index,
+                          const exclusion_t *exclusion, const int *uses, int max_uses, unsigned int *seed)
+{
+    int begin = 0, end = index->count;
+    while (begin < end)
+    {
+        int middle = begin + (end - begin) / 2;
+        if (index->luminance[middle] < Y)
+            begin = middle + 1;
+        else
+            end = middle;
+    }
+
+    int above = index->count - begin;
+    if (above <= 0)
+        return -1;
+
+    for (int probe = 0; probe < ABOVE_RANDOM_PROBES; probe++)
+    {
+        int k = index->ids[begin + random_below(seed, above)];
+        if (!is_unavailable(exclusion, uses, max_uses, k))
+            return k;
+    }
+
+    int allowed = 0;
+    for (int i = begin; i < index->count; i++)
+        allowed += !is_unavailable(exclusion, uses, max_uses, index->ids[i]);
+    if (allowed == 0)
+        return -1;
+
+    int pick = random_below(seed, allowed);
+    for (int i = begin;; i++)
+    {
+        if (!is_unavailable(exclusion, uses, max_uses, index->ids[i]) && pick-- == 0)
+            return index->ids[i];
     }
-    return 0;
 }
 
 /* Image manipulation */
@@ -333,6 +658,16 @@ image_t shrink_image_size(image_t image, int shrunk_width, int shrunk_height)
     return shrunk;
 }
 
+// toned values of all bytes, same truncation as tone * value
+static void get_toned_values(float tone, uint8_t *toned)
+{
+    for (int v = 0; v < 256; v++)
+    {
+        float value = tone * v;
+        toned[v] = value >= 255 ? 255 : (value <= 0 ? 0 : (uint8_t)value);
+    }
+}
+
 bool paste_image_at_pos(image_t image_to, image_t image_from, int x, int y, float tone)
 {
     size_t image_to_size = get_image_size(image_to);
@@ -351,237 +686,1195 @@ bool paste_image_at_pos(image_t image_to, image_t image_from, int x, int y, floa
         return false;
     }
 
-    uint8_t *img_to_i = image_to.pix,
+    size_t row_from = (size_t)image_from.w * image_from.ch,
+           row_to = (size_t)image_to.w * image_to.ch;
+    uint8_t *img_to_i = image_to.pix + image_to.ch * ((size_t)y * image_to.w + x),
             *img_from_i = image_from.pix;
 
-    // go to x, y on image_to
-    img_to_i += image_to.ch * (y * image_to.w + x);
-
-    int p = 1;
-    while (img_from_i < image_from.pix + image_from_size &&
-           img_to_i < image_to.pix + image_to_size)
+    // untoned tiles are whole rows of memory
+    if (tone == 1 && image_from.ch == image_to.ch)
     {
-        // copy pixel
-        *img_to_i = tone * (uint8_t)*img_from_i;
-        *(img_to_i + 1) = tone * (uint8_t) * (img_from_i + 1);
-        *(img_to_i + 2) = tone * (uint8_t) * (img_from_i + 2);
+        for (int row = 0; row < image_from.h; row++)
+            memcpy(img_to_i + row * row_to, img_from_i + row * row_from, row_from);
+        return true;
+    }
+
+    uint8_t toned[256];
+    get_toned_values(tone, toned);
 
-        // jump over every other line
-        if (p % image_from.w == 0)
+    for (int row = 0; row < image_from.h; row++)
+    {
+        uint8_t *to = img_to_i + row * row_to;
+        const uint8_t *from = img_from_i + row * row_from;
+        for (int px = 0; px < image_from.w; px++)
         {
-            img_to_i += image_to.ch * (image_to.w - image_from.w);
+            to[0] = toned[from[0]];
+            to[1] = toned[from[1]];
+            to[2] = toned[from[2]];
+            to += image_to.ch;
+            from += image_from.ch;
         }
+    }
 
-        // go to next pixel
-        img_to_i += image_to.ch;
-        img_from_i += image_from.ch;
-        p++;
+    return true;
+}
+
+/*
+ * Streaming: collages are rendered in bands of units (tile rows) that are
+ * passed to a row sink, so only one band of the collage is in memory. A
+ * band holds a unit per thread, rendered in parallel, border included.
+ * The sink consumes a band on a thread of its own while the next band is
+ * rendered into a second buffer, so encoding overlaps rendering.
+ */
+
+// renders the inner pixels of unit into rows, stride bytes per image row
+typedef void (*render_unit_t)(int unit, uint8_t *rows, size_t stride, void *arg);
+
+typedef struct
+{
+    render_unit_t render;
+    void *arg;
+    uint8_t *band;
+    int first_unit, unit_height;
+    int inner_w, ch;
+    size_t stride;
+    border_t border;
+} band_job_t;
+
+static void render_band_unit(int u, void *arg)
+{
+    band_job_t *job = arg;
+    border_t border = job->border;
+    uint8_t *rows = job->band + (size_t)u * job->unit_height * job->stride;
+
+    for (int row = 0; row < job->unit_height; row++)
+    {
+        uint8_t *line = rows + row * job->stride;
+        put_pixels(line, border.left, border.red, border.green, border.blue);
+        put_pixels(line + (size_t)(border.left + job->inner_w) * job->ch, border.right,
+                   border.red, border.green, border.blue);
     }
+    job->render(job->first_unit + u, rows + (size_t)border.left * job->ch, job->stride, job->arg);
+}
 
+typedef struct
+{
+    row_sink_t *sink;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint8_t *bands[2];
+    int next;            // buffer of the next band
+    const uint8_t *rows; // band handed to the sink, NULL once written
+    int count;
+    bool finished, success;
+} band_writer_t;
+
+static void *write_bands(void *arg)
+{
+    band_writer_t *writer = arg;
+    pthread_mutex_lock(&writer->lock);
+    for (;;)
+    {
+        while (writer->rows == NULL && !writer->finished)
+            pthread_cond_wait(&writer->changed, &writer->lock);
+        if (writer->rows == NULL)
+            break;
+
+        pthread_mutex_unlock(&writer->lock);
+        bool success = writer->sink->write_rows(writer->sink, writer->rows, writer->count);
+        pthread_mutex_lock(&writer->lock);
+        writer->success = writer->success && success;
+        writer->rows = NULL;
+        pthread_cond_broadcast(&writer->changed);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// waits until the sink wrote the previous band, then hands it count rows of band
+static bool hand_over_band(band_writer_t *writer, uint8_t *band, int count)
+{
+    pthread_mutex_lock(&writer->lock);
+    while (writer->rows != NULL)
+        pthread_cond_wait(&writer->changed, &writer->lock);
+    bool success = writer->success;
+    if (success)
+    {
+        writer->rows = band;
+        writer->count = count;
+        writer->next = 1 - writer->next;
+        pthread_cond_broadcast(&writer->changed);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return success;
+}
+
+// count rows of the border colour, written band by band
+static bool write_border_rows(band_writer_t *writer, int band_rows, int w, int count, border_t border)
+{
+    for (; count > 0; count -= band_rows)
+    {
+        uint8_t *band = writer->bands[writer->next];
+        int rows = count < band_rows ? count : band_rows;
+        put_pixels(band, w * rows, border.red, border.green, border.blue);
+        if (!hand_over_band(writer, band, rows))
+            return false;
+    }
     return true;
 }
 
-image_t collage_from_single_image(image_t base, image_t paste, int mode)
+static bool stream_units(int inner_w, int units, int unit_height, int ch, border_t border,
+                         render_unit_t render, void *arg, thread_pool_t *pool, row_sink_t *sink)
+{
+    int w = inner_w + border.left + border.right,
+        h = units * unit_height + border.top + border.bottom;
+    int band_units = pool != NULL ? pool->thread_count + 1 : 1;
+    int band_rows = band_units * unit_height > 0 ? band_units * unit_height : 1;
+    size_t stride = (size_t)w * ch;
+
+    band_writer_t writer = {sink};
+    writer.bands[0] = malloc(band_rows * stride);
+    writer.bands[1] = malloc(band_rows * stride);
+    writer.success = true;
+    pthread_mutex_init(&writer.lock, NULL);
+    pthread_cond_init(&writer.changed, NULL);
+
+    bool begun = writer.bands[0] != NULL && writer.bands[1] != NULL && sink->begin(sink, w, h, ch);
+    bool success = begun && pthread_create(&writer.thread, NULL, write_bands, &writer) == 0;
+    if (success)
+    {
+        band_job_t job = {render, arg, NULL, 0, unit_height, inner_w, ch, stride, border};
+        success = write_border_rows(&writer, band_rows, w, border.top, border);
+        for (int first = 0; success && first < units; first += band_units)
+        {
+            int count = units - first < band_units ? units - first : band_units;
+            job.band = writer.bands[writer.next];
+            job.first_unit = first;
+            if (pool != NULL)
+                thread_pool_run(pool, count, render_band_unit, &job);
+            else
+                for (int u = 0; u < count; u++)
+                    render_band_unit(u, &job);
+            success = hand_over_band(&writer, job.band, count * unit_height);
+        }
+        success = success && write_border_rows(&writer, band_rows, w, border.bottom, border);
+
+        pthread_mutex_lock(&writer.lock);
+        while (writer.rows != NULL)
+            pthread_cond_wait(&writer.changed, &writer.lock);
+        writer.finished = true;
+        pthread_cond_broadcast(&writer.changed);
+        pthread_mutex_unlock(&writer.lock);
+        pthread_join(writer.thread, NULL);
+        success = success && writer.success;
+    }
+    if (begun)
+        success = sink->end(sink) && success;
+
+    pthread_mutex_destroy(&writer.lock);
+    pthread_cond_destroy(&writer.changed);
+    free(writer.bands[0]);
+    free(writer.bands[1]);
+    return success;
+}
+
+static const int MAX_TONE_LEVELS = 256;
+
+// 4x4 Bayer matrix for ordered dithering of the tone levels
+static const uint8_t BAYER_4X4[4][4] = {
+    {0, 8, 2, 10},
+    {12, 4, 14, 6},
+    {3, 11, 1, 9},
+    {15, 7, 13, 5}};
+
+typedef struct
+{
+    image_t base, paste;
+    int mode;
+    single_options_t *options;
+    uint8_t *toned_tiles; // tone_levels copies of paste, or NULL
+} single_job_t;
+
+static float get_single_tone(single_job_t *job, int x, int y)
+{
+    image_t base = job->base;
+    uint8_t *pix = base.pix + ((size_t)y * base.w + x) * base.ch;
+    switch (job->mode)
+    {
+    default:
+    case 0:
+        return get_point_luminance(*pix, *(pix + 1), *(pix + 2));
+    case 1:
+        return fabs(sinf(x * M_PI / base.w) * sinf(y * M_PI / base.h));
+    }
+}
+
+// copy of paste toned to level
+static void tone_tile(int level, void *arg)
+{
+    single_job_t *job = arg;
+    image_t paste = job->paste;
+    size_t tile_size = get_image_size(paste);
+    uint8_t toned[256];
+    get_toned_values((float)level / (job->options->tone_levels - 1), toned);
+
+    uint8_t *to = job->toned_tiles + level * tile_size;
+    for (size_t b = 0; b < tile_size; b++)
+        to[b] = toned[paste.pix[b]];
+}
+
+// tone level of cell x, y, dithered between the two nearest levels
+static int get_tone_level(single_job_t *job, int x, int y)
+{
+    int levels = job->options->tone_levels;
+    float level = get_single_tone(job, x, y) * (levels - 1);
+    float threshold = job->options->dither ? (BAYER_4X4[y % 4][x % 4] + 0.5f) / 16 : 0.5f;
+    int l = (int)(level + threshold);
+    return l < 0 ? 0 : (l >= levels ? levels - 1 : l);
+}
+
+/*
+ * Renders the tiles of base row y, row by row of the collage: every output
+ * row is one toned row of paste per cell. With tone levels the rows are
+ * copied from the pre-toned tiles.
+ */
+static void render_single_unit(int y, uint8_t *rows, size_t stride, void *arg)
+{
+    single_job_t *job = arg;
+    image_t base = job->base, paste = job->paste;
+    size_t row_paste = (size_t)paste.w * paste.ch;
+
+    if (job->toned_tiles != NULL)
+    {
+        const uint8_t **tiles = malloc(base.w * sizeof(uint8_t *));
+        for (int x = 0; x < base.w; x++)
+            tiles[x] = job->toned_tiles + get_tone_level(job, x, y) * get_image_size(paste);
+
+        for (int row = 0; row < paste.h; row++)
+        {
+            uint8_t *to = rows + row * stride;
+            for (int x = 0; x < base.w; x++, to += row_paste)
+                memcpy(to, tiles[x] + row * row_paste, row_paste);
+        }
+        free(tiles);
+        return;
+    }
+
+    uint8_t *toned = malloc((size_t)base.w * 256);
+    for (int x = 0; x < base.w; x++)
+        get_toned_values(get_single_tone(job, x, y), toned + (size_t)x * 256);
+
+    for (int row = 0; row < paste.h; row++)
+    {
+        uint8_t *to = rows + row * stride;
+        for (int x = 0; x < base.w; x++)
+        {
+            const uint8_t *cell_toned = toned + (size_t)x * 256;
+            const uint8_t *from = paste.pix + row * row_paste;
+            for (int px = 0; px < paste.w; px++)
+            {
+                to[0] = cell_toned[from[0]];
+                to[1] = cell_toned[from[1]];
+                to[2] = cell_toned[from[2]];
+                to += paste.ch;
+                from += paste.ch;
+            }
+        }
+    }
+    free(toned);
+}
+
+// single collage of base with paste as tile, one band per base row
+bool stream_single_image(image_t base, image_t paste, int mode, single_options_t options, row_sink_t *sink)
 {
     if (!check_image_dimensions(base) ||
         !check_image_dimensions(paste) ||
         !(mode == 0 || mode == 1))
     {
         fprintf(stderr, "ERR: invalid input image dimensions or wrong function call\n");
-        return image_default;
+        return false;
     }
 
+    if (options.tone_levels == 1)
+        options.tone_levels = 2;
+    else if (options.tone_levels > MAX_TONE_LEVELS)
+        options.tone_levels = MAX_TONE_LEVELS;
+
+    single_job_t job = {base, paste, mode, &options, NULL};
+    thread_pool_t *pool = thread_pool_create(options.threads);
+
+    // without memory for the toned tiles every cell is toned exactly
+    if (options.tone_levels > 0)
+        job.toned_tiles = malloc((size_t)options.tone_levels * get_image_size(paste));
+    if (job.toned_tiles != NULL)
+    {
+        if (pool != NULL)
+            thread_pool_run(pool, options.tone_levels, tone_tile, &job);
+        else
+            for (int level = 0; level < options.tone_levels; level++)
+                tone_tile(level, &job);
+    }
+
+    bool success = stream_units(base.w * paste.w, base.h, paste.h, paste.ch, border_none,
+                                render_single_unit, &job, pool, sink);
+    thread_pool_destroy(pool);
+    free(job.toned_tiles);
+    return success;
+}
+
+image_t collage_from_single_image(image_t base, image_t paste, int mode, single_options_t options)
+{
     image_t collage;
-    collage.w = (base.w * paste.w);
-    collage.h = (base.h * paste.h);
-    collage.ch = paste.ch;
+    row_sink_t *sink = create_image_sink(&collage);
+    if (!stream_single_image(base, paste, mode, options, sink))
+    {
+        free(collage.pix);
+        collage = image_default;
+    }
+    free_row_sink(sink);
+    return collage;
+}
 
-    size_t collage_size = get_image_size(collage);
-    collage.pix = malloc(collage_size);
-    if (collage.pix == NULL)
+// shape and colour (optional) of the 2x2 creator pixels of cell i, j
+static void get_cell_descriptors(image_t creator, int i, int j, image_shape_t *S, image_color_t *C)
+{
+    uint8_t *cur_pix = creator.pix + (creator.w * i * 2 + j * 2) * creator.ch;
+    uint8_t *right_pix = creator.pix + (creator.w * i * 2 + (j * 2 + 1)) * creator.ch;
+    uint8_t *down_pix = creator.pix + (creator.w * (i * 2 + 1) + j * 2) * creator.ch;
+    uint8_t *down_right_pix = creator.pix + (creator.w * (i * 2 + 1) + (j * 2 + 1)) * creator.ch;
+
+    S->y1 = get_point_luminance(*(cur_pix), *(cur_pix + 1), *(cur_pix + 2));
+    S->y2 = get_point_luminance(*(right_pix), *(right_pix + 1), *(right_pix + 2));
+    S->y3 = get_point_luminance(*(down_pix), *(down_pix + 1), *(down_pix + 2));
+    S->y4 = get_point_luminance(*(down_right_pix), *(down_right_pix + 1), *(down_right_pix + 2));
+
+    if (C != NULL)
     {
-        return image_default;
+        uint8_t *quadrant_pix[4] = {cur_pix, right_pix, down_pix, down_right_pix};
+        for (int q = 0; q < 4; q++)
+        {
+            uint8_t *pix = quadrant_pix[q];
+            get_point_lab(*pix, *(pix + 1), *(pix + 2), &C->l[q], &C->a[q], &C->b[q]);
+        }
     }
+}
 
-    for (int x = 0; x < base.w; x++)
+// shape and colour (optional) of all cells of the creator image
+cell_grid_t get_cell_grid(image_t creator, bool with_color)
+{
+    cell_grid_t cells = {creator.h / 2, creator.w / 2, NULL, NULL};
+    size_t count = (size_t)cells.rows * cells.cols;
+    cells.shape = malloc(count * sizeof(image_shape_t));
+    if (with_color)
+        cells.color = malloc(count * sizeof(image_color_t));
+
+    for (int i = 0; i < cells.rows; i++)
+    {
+        for (int j = 0; j < cells.cols; j++)
+        {
+            size_t cell = (size_t)i * cells.cols + j;
+            get_cell_descriptors(creator, i, j, &cells.shape[cell],
+                                 with_color ? &cells.color[cell] : NULL);
+        }
+    }
+    return cells;
+}
+
+void free_cell_grid(cell_grid_t *cells)
+{
+    free(cells->shape);
+    free(cells->color);
+    cells->shape = NULL;
+    cells->color = NULL;
+}
+
+// descriptors of type of all cells in raster order
+static inline const float *get_grid_descriptors(const cell_grid_t *cells, descriptor_t type)
+{
+    return type == DESCRIPTOR_COLOR ? (const float *)cells->color : (const float *)cells->shape;
+}
+
+// descriptors of a cell, C stays default unless matched by colour
+static inline void get_grid_cell(const cell_grid_t *cells, int cell, image_shape_t *S, image_color_t *C)
+{
+    *S = cells->shape[cell];
+    *C = cells->color != NULL ? cells->color[cell] : image_color_default;
+}
+
+typedef struct
+{
+    const cell_grid_t *cells;
+    tile_library_t *library;
+    multi_options_t *options;
+    candidate_list_t *candidates;
+} candidate_job_t;
+
+// candidates of one collage row with the k-d tree, VP-tree or inverted file
+static void get_row_candidates(int i, void *arg)
+{
+    candidate_job_t *job = arg;
+    tile_library_t *library = job->library;
+    candidate_list_t *candidates = job->candidates;
+    int fotos_horiz = job->cells->cols;
+
+    for (int j = 0; j < fotos_horiz; j++)
+    {
+        int cell = i * fotos_horiz + j;
+        int *ids = candidates->ids + (size_t)cell * candidates->k;
+        float *distances = candidates->distances + (size_t)cell * candidates->k;
+        image_shape_t S;
+        image_color_t C;
+        get_grid_cell(job->cells, cell, &S, &C);
+
+        if (library->ivf_index.count > 0)
+            candidates->found[cell] = ivf_nearest(&library->ivf_index,
+                                                  job->options->mode_color ? (const float *)&C : (const float *)&S,
+                                                  candidates->k, ids, distances, NULL);
+        else if (library->kd_tree.node_count > 0 && !job->options->mode_color)
+            candidates->found[cell] = kd_tree_nearest(&library->kd_tree, S, candidates->k, ids, distances, NULL);
+        else
+            candidates->found[cell] = vp_tree_nearest(&library->vp_tree,
+                                                      job->options->mode_color ? (const float *)&C : (const float *)&S,
+                                                      candidates->k, ids, distances, NULL);
+    }
+}
+
+/*
+ * Top-k candidates of all cells, ignoring repetitions. Uses the index of
+ * the matcher, without one a temporary batch index.
+ */
+static candidate_list_t get_cell_candidates(const cell_grid_t *cells, tile_library_t *library,
+                                            multi_options_t *options, thread_pool_t *pool)
+{
+    int fotos_vert = cells->rows;
+    candidate_list_t candidates = alloc_candidate_list(options->candidates, cells->rows * cells->cols);
+
+    if (library->batch_index.count == 0 &&
+        (library->kd_tree.node_count > 0 || library->vp_tree.root >= 0 || library->ivf_index.count > 0))
+    {
+        candidate_job_t job = {cells, library, options, &candidates};
+        if (pool != NULL)
+            thread_pool_run(pool, fotos_vert, get_row_candidates, &job);
+        else
+            for (int i = 0; i < fotos_vert; i++)
+                get_row_candidates(i, &job);
+        return candidates;
+    }
+
+    batch_index_t temporary_index = batch_index_default;
+    batch_index_t *index = &library->batch_index;
+    if (index->count == 0)
+    {
+        if (options->mode_color)
+            build_batch_index(&temporary_index, DESCRIPTOR_COLOR, (const float *)library->color, library->count);
+        else
+            build_batch_index(&temporary_index, DESCRIPTOR_SHAPE, (const float *)library->structure, library->count);
+        index = &temporary_index;
+    }
+
+    batch_nearest(index, get_grid_descriptors(cells, index->type), &candidates);
+    free_batch_index(&temporary_index);
+    return candidates;
+}
+
+/*
+ * Best allowed photo for a collage cell with the matcher of options. Falls
+ * back to a linear scan if the index of the matcher was not built or all
+ * batch candidates (or probed lists) of the cell are not allowed.
+ */
+static int match_cell(tile_library_t *library, multi_options_t *options,
+                      image_shape_t S, image_color_t C,
+                      candidate_list_t *candidates, int cell,
+                      const exclusion_t *exclusion)
+{
+    int best_image = 0;
+    float best_distance;
+
+    switch (options->matcher)
     {
-        for (int y = 0; y < base.h; y++)
+    case MATCHER_BATCH:
+        if (candidates->found != NULL)
         {
-            uint8_t *pix = base.pix + (y * base.w + x) * base.ch;
-            float Y;
-            switch (mode)
+            int *ids = candidates->ids + (size_t)cell * candidates->k;
+            for (int c = 0; c < candidates->found[cell]; c++)
             {
-            default:
-            case 0:
-                Y = get_point_luminance(*pix, *(pix + 1), *(pix + 2));
-                break;
-            case 1:
-                Y = fabs(sinf(x * M_PI / base.w) * sinf(y * M_PI / base.h));
-                break;
+                if (!is_excluded(exclusion, ids[c]))
+                    return ids[c];
             }
-
-            bool success = paste_image_at_pos(collage, paste, x * paste.w, y * paste.h, Y);
-            if (!success)
-                break;
         }
+        break;
+    case MATCHER_IVF:
+        if (library->ivf_index.count > 0)
+        {
+            const float *descriptor = options->mode_color ? (const float *)&C : (const float *)&S;
+            if (ivf_nearest(&library->ivf_index, descriptor, 1, &best_image, &best_distance,
+                            exclusion) > 0)
+                return best_image;
+        }
+        break;
+    case MATCHER_COARSE:
+        if (library->luminance_index.count > 0)
+        {
+            const float *descriptor = options->mode_color ? (const float *)&C : (const float *)&S;
+            if (luminance_shortlist_nearest(&library->luminance_index, options->mode_color ? DESCRIPTOR_COLOR : DESCRIPTOR_SHAPE,
+                                            options->mode_color ? (const float *)library->color : (const float *)library->structure,
+                                            (S.y1 + S.y2 + S.y3 + S.y4) / 4, descriptor, options->shortlist,
+                                            1, &best_image, &best_distance, exclusion) > 0)
+                return best_image;
+        }
+        break;
+    case MATCHER_KD_TREE:
+        if (library->kd_tree.node_count > 0)
+        {
+            kd_tree_nearest(&library->kd_tree, S, 1, &best_image, &best_distance,
+                            exclusion);
+            return best_image;
+        }
+        // colour descriptors are only indexed by the VP-tree
+        // fall through
+    case MATCHER_VP_TREE:
+        if (library->vp_tree.root >= 0)
+        {
+            const float *descriptor = options->mode_color ? (const float *)&C : (const float *)&S;
+            vp_tree_nearest(&library->vp_tree, descriptor, 1, &best_image, &best_distance,
+                            exclusion);
+            return best_image;
+        }
+    case MATCHER_LINEAR:
+    default:
+        break;
     }
 
-    return collage;
+    if (options->mode_color)
+        return match_image_by_color(C, library->color, library->count, exclusion);
+    if (library->shape_scan.count > 0)
+    {
+        best_image = shape_scan_nearest(&library->shape_scan, S, exclusion);
+        if (best_image >= 0)
+            return best_image;
+    }
+    return match_image_by_shape(S, library->structure, library->count, exclusion);
 }
 
-image_t collage_from_multiple_images(
-    image_t creator,
-    uint8_t **image_array, int image_width, int image_height, int image_count,
-    float *images_luminance, image_shape_t *images_structure,
-    bool mode_contour)
+// k nearest allowed photos with the index of the matcher, -1 without one
+static int get_nearest_photos(tile_library_t *library, multi_options_t *options,
+                              image_shape_t S, image_color_t C, int k, int *ids, float *distances,
+                              const exclusion_t *exclusion)
 {
-    if (!check_image_dimensions(creator))
+    const float *descriptor = options->mode_color ? (const float *)&C : (const float *)&S;
+
+    switch (options->matcher)
     {
-        fprintf(stderr, "ERR: wrong creator image dimensions\n");
-        print_image_dimensions("Dim: ", creator);
-        return image_default;
+    case MATCHER_IVF:
+        if (library->ivf_index.count > 0)
+            return ivf_nearest(&library->ivf_index, descriptor, k, ids, distances, exclusion);
+        break;
+    case MATCHER_COARSE:
+        if (library->luminance_index.count > 0)
+            return luminance_shortlist_nearest(&library->luminance_index, options->mode_color ? DESCRIPTOR_COLOR : DESCRIPTOR_SHAPE,
+                                               options->mode_color ? (const float *)library->color : (const float *)library->structure,
+                                               (S.y1 + S.y2 + S.y3 + S.y4) / 4, descriptor, options->shortlist,
+                                               k, ids, distances, exclusion);
+        break;
+    case MATCHER_KD_TREE:
+        if (library->kd_tree.node_count > 0)
+            return kd_tree_nearest(&library->kd_tree, S, k, ids, distances, exclusion);
+        // fall through
+    case MATCHER_VP_TREE:
+        if (library->vp_tree.root >= 0)
+            return vp_tree_nearest(&library->vp_tree, descriptor, k, ids, distances, exclusion);
+        break;
+    default:
+        break;
     }
+    return -1;
+}
 
-    size_t creator_size = get_image_size(creator);
-    int fotos_horiz = creator.w / 2,
-        fotos_vert = creator.h / 2;
+/*
+ * Best allowed photo via the match cache. The cached list holds the k
+ * nearest photos of the centre c of the cell's quantization bucket, the
+ * last at distance D. A photo outside the list is at least D - d(S, c) away
+ * from the cell (triangle inequality), so a list photo closer than that is
+ * exactly what the matcher would find. Otherwise the matcher is asked.
+ */
+static int match_cell_cached(tile_library_t *library, multi_options_t *options,
+                             image_shape_t S, image_color_t C,
+                             candidate_list_t *candidates, int cell,
+                             const exclusion_t *exclusion, match_cache_t *cache)
+{
+    const float *descriptor = options->mode_color ? (const float *)&C : (const float *)&S;
+    int key[12];
+    float centre[12];
+    get_match_cache_key(cache, descriptor, key, centre);
+    __atomic_add_fetch(&cache->lookups, 1, __ATOMIC_RELAXED);
+
+    match_cache_entry_t *entry = match_cache_find(cache, key);
+    if (entry == NULL)
+    {
+        int *ids = malloc(cache->k * sizeof(int));
+        float *distances = malloc(cache->k * sizeof(float));
+        image_shape_t centre_S = S;
+        image_color_t centre_C = C;
+        memcpy(options->mode_color ? (void *)&centre_C : (void *)&centre_S, centre, cache->dim * sizeof(float));
+
+        int found = get_nearest_photos(library, options, centre_S, centre_C, cache->k, ids, distances, NULL);
+        if (found < 0)
+            found = linear_nearest(cache->type,
+                                   options->mode_color ? (const float *)library->color : (const float *)library->structure,
+                                   library->count, centre, cache->k, ids, distances, NULL);
+        entry = match_cache_insert(cache, key, centre, ids, distances, found);
+        free(ids);
+        free(distances);
+    }
 
-    image_t collage;
-    collage.w = fotos_horiz * image_width;
-    collage.h = fotos_vert * image_height;
-    collage.ch = creator.ch;
+    // a list shorter than k holds the whole library
+    float bound = entry->count < cache->k
+                      ? INFINITY
+                      : entry->distances[entry->count - 1] - get_descriptor_difference(cache->type, descriptor, entry->centre);
 
-    size_t collage_size = get_image_size(collage);
-    collage.pix = malloc(collage_size);
+    int best_image = -1;
+    float best_distance = INFINITY;
+    for (int c = 0; c < entry->count; c++)
+    {
+        int k = entry->ids[c];
+        if (is_excluded(exclusion, k))
+            continue;
 
-    image_shape_t white_structure = {1.0f, 1.0f, 1.0f, 1.0f};
+        float d = get_descriptor_difference(cache->type, descriptor,
+                                            options->mode_color ? (const float *)&library->color[k] : (const float *)&library->structure[k]);
+        if (d < best_distance || (d == best_distance && k < best_image))
+        {
+            best_distance = d;
+            best_image = k;
+        }
+    }
 
-    int image_selection[fotos_vert][fotos_horiz];
-    for (int i = 0; i < fotos_vert; i++)
+    // margin against rounding of the float distances
+    if (best_image >= 0 && best_distance < bound - MATCH_CACHE_MARGIN * fabsf(bound))
     {
-        for (int j = 0; j < fotos_horiz; j++)
-        {
-            uint8_t *cur_pix = creator.pix + (creator.w * i * 2 + j * 2) * creator.ch;
-            uint8_t *right_pix = creator.pix + (creator.w * i * 2 + (j * 2 + 1)) * creator.ch;
-            uint8_t *down_pix = creator.pix + (creator.w * (i * 2 + 1) + j) * creator.ch;
-            uint8_t *down_right_pix = creator.pix + (creator.w * (i * 2 + 1) + (j * 2 + 1)) * creator.ch;
+        __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+        return best_image;
+    }
+    return match_cell(library, options, S, C, candidates, cell, exclusion);
+}
 
-            if (down_right_pix >= creator.pix + creator_size)
-                return collage;
+/*
+ * Ranks candidates of ascending distance by distance + penalty * uses.
+ * Returns true as soon as a distance alone is not below the best cost,
+ * then no later candidate (or photo outside the list) can be better.
+ */
+static bool rank_by_usage(const int *ids, const float *distances, int found,
+                          float penalty, int max_uses, const int *uses, const exclusion_t *exclusion,
+                          int *best_image, float *best_cost)
+{
+    for (int c = 0; c < found; c++)
+    {
+        if (distances[c] >= *best_cost)
+            return true;
+        if (is_excluded(exclusion, ids[c]) || (max_uses > 0 && uses[ids[c]] >= max_uses))
+            continue;
 
-            image_shape_t S = {
-                get_point_luminance(*(cur_pix), *(cur_pix + 1), *(cur_pix + 2)),
-                get_point_luminance(*(right_pix), *(right_pix + 1), *(right_pix + 2)),
-                get_point_luminance(*(down_pix), *(down_pix + 1), *(down_pix + 2)),
-                get_point_luminance(*(down_right_pix), *(down_right_pix + 1), *(down_right_pix + 2)),
-            };
+        float cost = distances[c] + penalty * uses[ids[c]];
+        if (cost < *best_cost)
+        {
+            *best_cost = cost;
+            *best_image = ids[c];
+        }
+    }
+    return false;
+}
 
-            // TODO: calculate radius according to amount of photos
-            int not_allowed_radius = 2,
-                not_allowed[not_allowed_radius * not_allowed_radius],
-                not_allowed_count = 0;
+/*
+ * Best allowed photo for distance + penalty * uses, photos with max_uses
+ * (> 0) uses are skipped. The top-k list of the index is re-ranked lazily,
+ * only if it runs out before the best cost is certain a twice as long list
+ * is requested. Without an index (or with the fixed batch candidates) the
+ * library is scanned. If all photos are at their cap the cap is ignored.
+ */
+static int match_cell_by_usage(tile_library_t *library, multi_options_t *options,
+                               image_shape_t S, image_color_t C,
+                               candidate_list_t *candidates, int cell,
+                               const exclusion_t *exclusion, const int *uses)
+{
+    float penalty = options->usage_penalty * (options->mode_color ? COLOR_DISTANCE_SCALE : 1);
+    int best_image = -1;
+    float best_cost = INFINITY;
+    bool certain = false;
 
-            for (int k = i - not_allowed_radius; k <= i; k++)
+    if (options->matcher == MATCHER_BATCH && candidates->found != NULL)
+    {
+        int found = candidates->found[cell];
+        certain = rank_by_usage(candidates->ids + (size_t)cell * candidates->k,
+                                candidates->distances + (size_t)cell * candidates->k, found,
+                                penalty, options->max_uses, uses, exclusion, &best_image, &best_cost) ||
+                  found < candidates->k;
+    }
+    else
+    {
+        for (int k = USAGE_CANDIDATES; !certain; k *= 2)
+        {
+            int *ids = malloc(k * sizeof(int));
+            float *distances = malloc(k * sizeof(float));
+            int found = get_nearest_photos(library, options, S, C, k, ids, distances, exclusion);
+            if (found >= 0)
             {
-                for (int l = j - not_allowed_radius; l <= j + not_allowed_radius; l++)
-                {
-                    if (k >= 0 && l >= 0 && !(k == i && l >= j))
-                        not_allowed[not_allowed_count++] = image_selection[k][l];
-                }
+                best_image = -1;
+                best_cost = INFINITY;
+                certain = rank_by_usage(ids, distances, found, penalty, options->max_uses, uses, exclusion,
+                                        &best_image, &best_cost) ||
+                          found < k;
             }
+            free(ids);
+            free(distances);
+            if (found < 0)
+                break;
+        }
+    }
 
-            int best_image;
-            if (mode_contour && get_shape_difference(S, white_structure) < 0.8f)
-            {
-                best_image = match_any_image_above(
-                    0.2f, images_luminance, image_count,
-                    not_allowed, not_allowed_count);
-            }
-            else
+    if (!certain)
+    {
+        best_image = -1;
+        best_cost = INFINITY;
+        for (int k = 0; k < library->count; k++)
+        {
+            if ((options->mode_color ? is_default_color(library->color[k]) : is_default_shape(library->structure[k])) ||
+                is_excluded(exclusion, k) || (options->max_uses > 0 && uses[k] >= options->max_uses))
+                continue;
+
+            float d = options->mode_color ? color_difference(&C, &library->color[k])
+                                          : shape_difference(&S, &library->structure[k]);
+            if (d + penalty * uses[k] < best_cost)
             {
-                best_image = match_image_by_shape(
-                    S, images_structure, image_count,
-                    not_allowed, not_allowed_count);
+                best_cost = d + penalty * uses[k];
+                best_image = k;
             }
-
-            uint8_t *selected_image = image_array[best_image];
-            image_selection[i][j] = best_image;
-
-            image_t selected_image_s;
-            selected_image_s.pix = selected_image;
-            selected_image_s.w = image_width;
-            selected_image_s.h = image_height;
-            selected_image_s.ch = collage.ch;
-            paste_image_at_pos(collage, selected_image_s,
-                               j * image_width, i * image_height, 1);
         }
     }
 
-    return collage;
+    if (best_image < 0)
+        return match_cell(library, options, S, C, candidates, cell, exclusion);
+    return best_image;
 }
 
-image_t get_contour_image(image_t image)
+/*
+ * Rows of a multi collage are matched in parallel as a pipeline: cell i, j
+ * waits until row i - 1 has placed the cells up to j + radius, which covers
+ * its whole exclusion window (the rows above are even further ahead). Rows
+ * finish in order, so with the rows handed out in ascending order by the
+ * pool at most threads rows are in flight and a selection ring of
+ * radius + threads rows is enough. The result equals the sequential scan.
+ * Usage aware matching depends on all previous cells, there every row
+ * waits for the whole row above.
+ */
+typedef struct
 {
-    // TODO
-    return image_default;
+    const cell_grid_t *cells;
+    tile_library_t *library;
+    multi_options_t *options;
+    candidate_list_t *candidates;
+    int *assignment;
+    int *uses;      // per photo for usage aware matching, else NULL
+    int *placement; // photo of every cell
+    match_cache_t *cache; // or NULL
+
+    exclusion_t *windows; // one per row in flight, row i uses i % window_slots
+    int window_slots;
+
+    int *progress; // placed cells per row
+    int waiting;   // threads waiting for progress
+    pthread_mutex_t lock;
+    pthread_cond_t progress_made;
+} row_job_t;
+
+static const image_shape_t WHITE_STRUCTURE = {1.0f, 1.0f, 1.0f, 1.0f};
+
+static bool is_white_cell(multi_options_t *options, image_shape_t S)
+{
+    return options->mode_contour && get_shape_difference(S, WHITE_STRUCTURE) < 0.8f;
+}
+
+static void wait_for_progress(row_job_t *job, int i, int cells)
+{
+    if (__atomic_load_n(&job->progress[i], __ATOMIC_SEQ_CST) >= cells)
+        return;
+
+    pthread_mutex_lock(&job->lock);
+    __atomic_add_fetch(&job->waiting, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&job->progress[i], __ATOMIC_SEQ_CST) < cells)
+        pthread_cond_wait(&job->progress_made, &job->lock);
+    __atomic_sub_fetch(&job->waiting, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&job->lock);
+}
+
+static void publish_progress(row_job_t *job, int i, int cells)
+{
+    __atomic_store_n(&job->progress[i], cells, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&job->waiting, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&job->lock);
+        pthread_cond_broadcast(&job->progress_made);
+        pthread_mutex_unlock(&job->lock);
+    }
 }
 
-image_t add_border(
-    image_t image,
-    int border_top, int border_bottom, int border_left, int border_right,
-    int border_red, int border_green, int border_blue)
+static void match_row(int i, void *arg)
 {
-    image_t new_image =
+    row_job_t *job = arg;
+    tile_library_t *library = job->library;
+    multi_options_t *options = job->options;
+    exclusion_t *exclusion = &job->windows[i % job->window_slots];
+    int fotos_horiz = job->cells->cols;
+
+    for (int j = 0; j < fotos_horiz; j++)
+    {
+        int cell = i * fotos_horiz + j;
+        if (i > 0)
         {
-            NULL,
-            image.w + border_left + border_right,
-            image.h + border_top + border_bottom,
-            image.ch};
+            int needed = job->uses != NULL ? fotos_horiz : j + options->radius + 1;
+            wait_for_progress(job, i - 1, needed < fotos_horiz ? needed : fotos_horiz);
+        }
 
-    size_t new_image_size = get_image_size(new_image);
-    new_image.pix = malloc(new_image_size);
+        image_shape_t S;
+        image_color_t C;
+        get_grid_cell(job->cells, cell, &S, &C);
 
-    uint8_t *img_i = image.pix, *img_border_i = new_image.pix;
-    int image_size = get_image_size(image);
-    int p = 0;
+        exclusion_move_to(exclusion, i, j);
 
-    // top border
-    img_border_i = put_pixels(
-        img_border_i, border_top * new_image.w,
-        border_red, border_green, border_blue);
+        // an assigned photo holds a slot in uses since the assignment, its own use included
+        int reserved = job->assignment != NULL ? job->assignment[cell] : -1;
+        bool take_reserved = reserved >= 0 && !is_excluded(exclusion, reserved) &&
+                             (job->uses == NULL || options->max_uses <= 0 || job->uses[reserved] <= options->max_uses);
+        if (reserved >= 0 && !take_reserved && job->uses != NULL)
+            job->uses[reserved]--;
 
-    while (img_i < image.pix + image_size)
+        int best_image;
+        if (is_white_cell(options, S))
+        {
+            // seeded per cell, independent of the thread that matches it
+            unsigned int seed = ((unsigned int)(cell + 1) * 2654435761u) ^ options->seed;
+            best_image = match_any_image_above(
+                0.2f, &library->luminance_index,
+                exclusion, job->uses, options->max_uses, &seed);
+            if (best_image < 0 && job->uses != NULL)
+                best_image = match_cell_by_usage(library, options, S, C,
+                                                 job->candidates, cell,
+                                                 exclusion, job->uses);
+            else if (best_image < 0)
+                best_image = match_cell(library, options, S, C,
+                                        job->candidates, cell,
+                                        exclusion);
+        }
+        else if (take_reserved)
+        {
+            best_image = reserved;
+        }
+        else if (job->uses != NULL)
+        {
+            best_image = match_cell_by_usage(library, options, S, C,
+                                             job->candidates, cell,
+                                             exclusion, job->uses);
+        }
+        else if (job->cache != NULL)
+        {
+            best_image = match_cell_cached(library, options, S, C,
+                                           job->candidates, cell,
+                                           exclusion, job->cache);
+        }
+        else
+        {
+            best_image = match_cell(library, options, S, C,
+                                    job->candidates, cell,
+                                    exclusion);
+        }
+
+        exclusion_place(exclusion, i, j, best_image);
+        job->placement[cell] = best_image;
+        if (job->uses != NULL && !take_reserved)
+            job->uses[best_image]++;
+
+        // the window has to be emptied before the last cell of the row is
+        // published, later rows overwrite the selection of the rows above
+        if (j == fotos_horiz - 1)
+            exclusion_clear(exclusion);
+        publish_progress(job, i, j + 1);
+    }
+}
+
+/*
+ * Photo of every cell of cells with the matcher of options, as a separate
+ * stage without any pixel work. cost holds the descriptor distance of every
+ * cell to its photo (in colour distance units if matched by colour).
+ */
+selection_grid_t select_photos(const cell_grid_t *cells, tile_library_t *library, multi_options_t options)
+{
+    int fotos_horiz = cells->cols,
+        fotos_vert = cells->rows;
+    int cell_count = fotos_horiz * fotos_vert;
+
+    int suitable_count = 0;
+    for (int k = 0; k < library->count; k++)
+    {
+        if (!is_default_shape(library->structure[k]))
+            suitable_count++;
+    }
+
+    if (options.radius < 0)
+        options.radius = get_auto_radius(suitable_count, fotos_vert, fotos_horiz);
+    if (options.candidates <= 0)
+        options.candidates = get_exclusion_window_size(options.radius) + 1;
+    if (options.shortlist <= 0)
+        options.shortlist = COARSE_SHORTLIST;
+    if (DEBUG)
+        printf("no repetition radius: %d\n", options.radius);
+
+    thread_pool_t *pool = thread_pool_create(options.threads);
+    candidate_list_t candidates = {0, 0, NULL, NULL, NULL};
+    int *assignment = NULL;
+
+    if (options.matcher == MATCHER_BATCH || options.assign_global || options.refine_seconds > 0)
     {
-        // left border
-        if (p % image.w == 0)
+        // the assignment needs candidates left after the photos of the neighbours within radius
+        multi_options_t candidate_options = options;
+        if (options.assign_global && candidate_options.candidates < get_exclusion_window_size(options.radius) + GLOBAL_CANDIDATES)
+            candidate_options.candidates = get_exclusion_window_size(options.radius) + GLOBAL_CANDIDATES;
+        candidates = get_cell_candidates(cells, library, &candidate_options, options.matcher != MATCHER_BATCH ? pool : NULL);
+
+        // white contour cells get random photos, not part of the assignment or refinement
+        for (int cell = 0; cell < cell_count; cell++)
         {
-            img_border_i = put_pixels(
-                img_border_i, border_left,
-                border_red, border_green, border_blue);
+            if (is_white_cell(&options, cells->shape[cell]) && (options.assign_global || options.refine_seconds > 0))
+                candidates.found[cell] = 0;
         }
 
-        // copy pixel
-        *img_border_i = (uint8_t)*img_i;
-        *(img_border_i + 1) = (uint8_t) * (img_i + 1);
-        *(img_border_i + 2) = (uint8_t) * (img_i + 2);
+        if (options.assign_global)
+        {
+            // white contour cells take their photos from the same uses
+            if (options.max_uses <= 0)
+                options.max_uses = (cell_count + suitable_count - 1) / (suitable_count > 0 ? suitable_count : 1);
+            assignment = assign_photos_global(&candidates, library->count, options.max_uses,
+                                              fotos_vert, fotos_horiz, options.radius, pool);
+
+            if (DEBUG)
+                printf("global assignment with %d uses per photo\n", options.max_uses);
+        }
+    }
+
+    // after the global assignment, which can set max_uses for the refinement
+    int *uses = options.usage_penalty > 0 || options.max_uses > 0 ? calloc(library->count, sizeof(int)) : NULL;
 
-        // right border
-        if (p % image.w == image.w - 1)
+    // assigned photos are counted up front, they reserve their slots from the other cells
+    for (int cell = 0; assignment != NULL && cell < cell_count; cell++)
+    {
+        if (assignment[cell] >= 0)
+            uses[assignment[cell]]++;
+    }
+
+    selection_grid_t selection = {fotos_vert, fotos_horiz, NULL, NULL};
+    selection.photos = malloc((size_t)cell_count * sizeof(int));
+    selection.cost = malloc((size_t)cell_count * sizeof(float));
+
+    // the cache only pays off for matchers that search the library per cell
+    match_cache_t cache;
+    bool use_cache = options.match_cache && uses == NULL &&
+                     (options.matcher == MATCHER_LINEAR || options.matcher == MATCHER_KD_TREE ||
+                      options.matcher == MATCHER_VP_TREE);
+    if (use_cache)
+        init_match_cache(&cache, options.mode_color ? DESCRIPTOR_COLOR : DESCRIPTOR_SHAPE, 2 * options.candidates);
+
+    row_job_t job = {cells, library, &options, &candidates, assignment, uses, selection.photos,
+                     use_cache ? &cache : NULL};
+    job.window_slots = pool != NULL ? pool->thread_count + 1 : 1;
+    job.windows = malloc(job.window_slots * sizeof(exclusion_t));
+    job.windows[0] = alloc_exclusion(library->count, options.radius, options.radius + job.window_slots,
+                                     fotos_vert, fotos_horiz);
+    for (int w = 1; w < job.window_slots; w++)
+        job.windows[w] = share_exclusion(&job.windows[0], library->count);
+    job.progress = calloc(fotos_vert, sizeof(int));
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.progress_made, NULL);
+
+    if (pool != NULL)
+        thread_pool_run(pool, fotos_vert, match_row, &job);
+    else
+        for (int i = 0; i < fotos_vert; i++)
+            match_row(i, &job);
+
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.progress_made);
+    free(job.progress);
+    for (int w = job.window_slots - 1; w >= 0; w--)
+        free_exclusion(&job.windows[w]);
+    free(job.windows);
+    if (use_cache)
+    {
+        if (DEBUG)
+            printf("match cache: %d lists for %ld cells, %ld answered from a list\n", cache.count, cache.lookups, cache.hits);
+        free_match_cache(&cache);
+    }
+
+    if (DEBUG && assignment != NULL)
+    {
+        int assigned = 0, kept = 0;
+        for (int cell = 0; cell < cell_count; cell++)
         {
-            img_border_i = put_pixels(
-                img_border_i, border_right,
-                border_red, border_green, border_blue);
+            assigned += assignment[cell] >= 0;
+            kept += assignment[cell] >= 0 && selection.photos[cell] == assignment[cell];
         }
+        printf("global assignment: %d of %d cells assigned, %d kept\n", assigned, cell_count, kept);
+    }
 
-        img_border_i += new_image.ch;
-        img_i += image.ch;
-        p++;
+    descriptor_t type = options.mode_color ? DESCRIPTOR_COLOR : DESCRIPTOR_SHAPE;
+    const float *cell_descriptors = get_grid_descriptors(cells, type);
+
+    if (options.refine_seconds > 0)
+    {
+        long accepted = refine_placement(selection.photos, fotos_vert, fotos_horiz, cell_descriptors,
+                                         library, &options, &candidates, uses, options.refine_seconds, pool);
+        if (DEBUG)
+            printf("refinement: %ld changes accepted\n", accepted);
+    }
+    thread_pool_destroy(pool);
+
+    const float *photo_descriptors = options.mode_color ? (const float *)library->color : (const float *)library->structure;
+    int dim = get_descriptor_dimension(type);
+    double total_cost = 0;
+    for (int cell = 0; cell < cell_count; cell++)
+    {
+        selection.cost[cell] = get_descriptor_difference(type, cell_descriptors + (size_t)cell * dim,
+                                                         photo_descriptors + (size_t)selection.photos[cell] * dim);
+        total_cost += selection.cost[cell];
+    }
+    if (DEBUG)
+        printf("mean distance of a cell to its photo: %.4f\n", total_cost / (cell_count > 0 ? cell_count : 1));
+
+    if (DEBUG && uses != NULL)
+    {
+        int used = 0, most_uses = 0;
+        for (int k = 0; k < library->count; k++)
+        {
+            used += uses[k] > 0;
+            most_uses = uses[k] > most_uses ? uses[k] : most_uses;
+        }
+        printf("%d photos used, at most %d times\n", used, most_uses);
+    }
+
+    free_candidate_list(&candidates);
+    free(assignment);
+    free(uses);
+    return selection;
+}
+
+void free_selection_grid(selection_grid_t *selection)
+{
+    free(selection->photos);
+    free(selection->cost);
+    selection->photos = NULL;
+    selection->cost = NULL;
+}
+
+typedef struct
+{
+    const selection_grid_t *selection;
+    tile_library_t *library;
+    int ch;
+} render_job_t;
+
+// pastes the photos of collage row i
+static void render_tile_row(int i, uint8_t *rows, size_t stride, void *arg)
+{
+    render_job_t *job = arg;
+    tile_library_t *library = job->library;
+    int fotos_horiz = job->selection->cols;
+    size_t row_tile = (size_t)library->w * job->ch;
+
+    for (int j = 0; j < fotos_horiz; j++)
+    {
+        const uint8_t *tile = library->images[job->selection->photos[i * fotos_horiz + j]];
+        for (int row = 0; row < library->h; row++)
+            memcpy(rows + row * stride + j * row_tile, tile + row * row_tile, row_tile);
+    }
+}
+
+// streams the photos of selection with border around them, the rows in parallel
+bool stream_selection(const selection_grid_t *selection, tile_library_t *library, int channels,
+                      border_t border, int threads, row_sink_t *sink)
+{
+    render_job_t job = {selection, library, channels};
+    thread_pool_t *pool = thread_pool_create(threads);
+    bool success = stream_units(selection->cols * library->w, selection->rows, library->h, channels, border,
+                                render_tile_row, &job, pool, sink);
+    thread_pool_destroy(pool);
+    return success;
+}
+
+image_t render_selection(const selection_grid_t *selection, tile_library_t *library, int channels, int threads)
+{
+    image_t collage;
+    row_sink_t *sink = create_image_sink(&collage);
+    if (!stream_selection(selection, library, channels, border_none, threads, sink))
+    {
+        free(collage.pix);
+        collage = image_default;
+    }
+    free_row_sink(sink);
+    return collage;
+}
+
+bool stream_multiple_images(image_t creator, tile_library_t *library, multi_options_t options,
+                            border_t border, row_sink_t *sink)
+{
+    if (!check_image_dimensions(creator))
+    {
+        fprintf(stderr, "ERR: wrong creator image dimensions\n");
+        print_image_dimensions("Dim: ", creator);
+        return false;
+    }
+
+    cell_grid_t cells = get_cell_grid(creator, options.mode_color);
+    selection_grid_t selection = select_photos(&cells, library, options);
+    free_cell_grid(&cells);
+
+    bool success = stream_selection(&selection, library, creator.ch, border, options.threads, sink);
+    free_selection_grid(&selection);
+    return success;
+}
+
+// multi collage as jpeg to target, entropy coded from the DCT blocks of the photos
+bool assemble_multiple_images_jpeg(image_t creator, tile_library_t *library, multi_options_t options,
+                                   output_target_t target, int quality)
+{
+    if (!check_image_dimensions(creator))
+    {
+        fprintf(stderr, "ERR: wrong creator image dimensions\n");
+        print_image_dimensions("Dim: ", creator);
+        return false;
     }
 
-    // bottom border
-    img_border_i = put_pixels(
-        img_border_i, border_bottom * new_image.w,
-        border_red, border_green, border_blue);
+    cell_grid_t cells = get_cell_grid(creator, options.mode_color);
+    selection_grid_t selection = select_photos(&cells, library, options);
+    free_cell_grid(&cells);
 
-    return new_image;
-}
\ No newline at end of file
+    bool success = write_jpeg_mosaic(target, quality, options.threads, &selection, library, creator.ch);
+    free_selection_grid(&selection);
+    return success;
+}
+
+image_t collage_from_multiple_images(image_t creator, tile_library_t *library, multi_options_t options)
+{
+    image_t collage;
+    row_sink_t *sink = create_image_sink(&collage);
+    if (!stream_multiple_images(creator, library, options, border_none, sink))
+    {
+        free(collage.pix);
+        collage = image_default;
+    }
+    free_row_sink(sink);
+    return collage;
+}
+
+image_t get_contour_image(image_t image)
+{
+    // TODO
+    return image_default;
+}
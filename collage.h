@@ -2,8 +2,16 @@
 #define COLLAGE_H
 
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <math.h>
+
+#include "thread-pool.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Constants */
 
@@ -21,6 +29,14 @@ static const float LUMINANCE_GREEN = 0.7152f;
 static const float LUMINANCE_BLUE = 0.0722f;
 static const float LUMINANCE_POWER_CURVE = 2.2f;
 
+// weights of the CIELAB channels in get_color_difference
+static const float LAB_WEIGHT_L = 1.0f;
+static const float LAB_WEIGHT_A = 0.5f;
+static const float LAB_WEIGHT_B = 0.5f;
+
+// colour distances per luminance distance (CIELAB L is 0-100, luminance 0-1)
+static const float COLOR_DISTANCE_SCALE = 100.0f;
+
 static const int MAX_DIMENSION = 10000;
 static const int MAX_CHANNELS = 3;
 static const int ALLOWED_CHANNELS = 3; // TODO: allow more channels
@@ -46,6 +62,348 @@ typedef struct
 
 static const image_shape_t image_shape_default = {0, 0, 0, 0};
 
+// mean CIELAB colour of the four quadrants (same order as image_shape_t)
+typedef struct
+{
+    float l[4], a[4], b[4];
+} image_color_t;
+
+static const image_color_t image_color_default = {{0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}};
+
+/*
+ * Photos used in the neighbourhood of the current cell of a raster scan:
+ * the radius rows above (radius columns to each side) and the radius cells
+ * to the left. window_count holds the uses per photo inside the window.
+ * Only the last ring rows of the selection are kept (ring buffer), windows
+ * of rows matched in parallel share one selection (share_exclusion).
+ */
+typedef struct
+{
+    int radius;
+    int rows, cols;    // collage grid
+    int ring;          // rows of the selection, at least radius + 1
+    int *selection;    // ring * cols placed photos, -1 if none
+    int *window_count; // per photo
+    int i, j;          // cell of the window, -1 if none
+    bool shared;       // selection belongs to another window
+} exclusion_t;
+
+typedef enum
+{
+    DESCRIPTOR_SHAPE, // image_shape_t, L1 distance
+    DESCRIPTOR_COLOR, // image_color_t, weighted CIELAB distance
+} descriptor_t;
+
+typedef enum
+{
+    MATCHER_LINEAR,
+    MATCHER_KD_TREE, // falls back to MATCHER_VP_TREE for colour descriptors
+    MATCHER_VP_TREE,
+    MATCHER_BATCH, // brute force top-k of all cells at once
+    MATCHER_IVF,   // approximate, inverted file with product quantization
+    MATCHER_COARSE, // approximate, photos of similar luminance re-ranked by descriptor
+} matcher_t;
+
+typedef struct
+{
+    float min[4], max[4]; // bounding box of the node
+    int left, right;      // child nodes, -1 for leaves
+    int begin, end;       // range in kd_tree_t.ids
+} kd_node_t;
+
+typedef struct
+{
+    kd_node_t *nodes;
+    int *ids;
+    int node_count;
+    image_shape_t *structure;
+} kd_tree_t;
+
+static const kd_tree_t kd_tree_default = {NULL, NULL, 0, NULL};
+
+typedef struct
+{
+    int id;
+    float mu;            // median distance to id, inside is <= mu
+    int inside, outside; // child nodes, -1 if empty
+} vp_node_t;
+
+typedef struct
+{
+    vp_node_t *nodes;
+    int node_count, root;
+    descriptor_t type;
+    const float *descriptors;
+} vp_tree_t;
+
+static const vp_tree_t vp_tree_default = {NULL, 0, -1, DESCRIPTOR_SHAPE, NULL};
+
+// descriptors as structure of arrays for the batch matcher
+typedef struct
+{
+    descriptor_t type;
+    int dim, count, stride; // stride is count padded to the SIMD width
+    int *ids;               // photo id of every column
+    float *data;            // dim rows of stride floats
+} batch_index_t;
+
+static const batch_index_t batch_index_default = {DESCRIPTOR_SHAPE, 0, 0, 0, NULL, NULL};
+
+// k-means lists of photos with one byte codes per quadrant for MATCHER_IVF
+typedef struct
+{
+    descriptor_t type;
+    int dim, count;
+    int list_count, probes; // lists, lists scanned per query
+    float *centroids;       // list_count * dim
+    vp_tree_t centroid_tree;
+    int *list_begin; // list_count + 1, range of a list in ids and codes
+    int *ids;
+    uint8_t *codes;           // 4 per photo
+    float *codebooks;         // 4 * 256 quadrant centroids
+    int codebook_size;        // trained codes per quadrant
+    const float *descriptors; // exact descriptors for re-ranking
+} ivf_index_t;
+
+static const ivf_index_t ivf_index_default = {DESCRIPTOR_SHAPE, 0, 0, 0, 0, NULL, {NULL, 0, -1, DESCRIPTOR_SHAPE, NULL},
+                                              NULL, NULL, NULL, NULL, 0, NULL};
+
+// k nearest photos of count cells, ascending distance
+typedef struct
+{
+    int k, count;
+    int *ids;         // count * k
+    float *distances; // count * k
+    int *found;       // count, number of valid candidates per cell
+} candidate_list_t;
+
+// shapes sorted by the sum of their quadrants for the pruned linear scan
+typedef struct
+{
+    int count;
+    int *ids;
+    float *sum;               // of ids, ascending
+    image_shape_t *structure; // of ids
+} shape_scan_t;
+
+static const shape_scan_t shape_scan_default = {0, NULL, NULL, NULL};
+
+// descriptors of the cells of a multi collage in raster order
+typedef struct
+{
+    int rows, cols;
+    image_shape_t *shape;
+    image_color_t *color; // NULL if not matched by colour
+} cell_grid_t;
+
+// photo of every cell of a multi collage in raster order
+typedef struct
+{
+    int rows, cols;
+    int *photos;
+    float *cost; // descriptor distance of the cell to its photo
+} selection_grid_t;
+
+// photos sorted by ascending average luminance
+typedef struct
+{
+    int count;
+    int *ids;
+    float *luminance; // of ids
+} luminance_index_t;
+
+static const luminance_index_t luminance_index_default = {0, NULL, NULL};
+
+// photos of a multi collage with their descriptors and search indexes
+typedef struct
+{
+    uint8_t **images;
+    int w, h, count;
+    float *luminance;
+    image_shape_t *structure;
+    image_color_t *color;
+    kd_tree_t kd_tree;
+    vp_tree_t vp_tree;
+    batch_index_t batch_index;
+    ivf_index_t ivf_index;
+    luminance_index_t luminance_index;
+    shape_scan_t shape_scan;
+} tile_library_t;
+
+// top-k photos of a quantized cell descriptor
+typedef struct
+{
+    int key[12];      // quantized descriptor
+    float centre[12]; // descriptor the photos are ranked for
+    int count;
+    int *ids;
+    float *distances; // ascending
+} match_cache_entry_t;
+
+// hash table of match_cache_entry_t, safe for several threads
+typedef struct
+{
+    descriptor_t type;
+    int dim, k;
+    pthread_mutex_t lock;
+    match_cache_entry_t **entries; // open addressing, NULL if empty
+    int capacity, count;
+    long hits, lookups; // cells answered from the cache, all cells
+} match_cache_t;
+
+typedef struct
+{
+    bool mode_contour;
+    bool mode_color;
+    matcher_t matcher;
+    int candidates; // top-k per cell for MATCHER_BATCH, 0 = exclusion window + 1
+    int radius;     // no repetition radius in cells, -1 = get_auto_radius
+    bool assign_global; // assign photos to all cells at once (auction)
+    int max_uses;       // per photo, 0 = no limit (cells / photos rounded up for assign_global)
+    int threads;        // 0 = all cpus
+    int probes;         // lists scanned by MATCHER_IVF (recall vs speed), 0 = default
+    float usage_penalty; // cost per previous use of a photo (luminance units), 0 = off
+    float refine_seconds; // time budget of the annealing refinement, 0 = off
+    bool match_cache;     // share candidates of cells with similar descriptors
+    int shortlist;        // photos re-ranked per cell by MATCHER_COARSE, 0 = default
+    unsigned int seed;    // of the random photos of white contour cells
+} multi_options_t;
+
+static const multi_options_t multi_options_default = {true, false, MATCHER_KD_TREE, 0, -1, false, 0, 0, 0, 0, 0, true, 0, 0};
+
+// solid frame around a streamed collage
+typedef struct
+{
+    int top, bottom, left, right;
+    uint8_t red, green, blue;
+} border_t;
+
+static const border_t border_none = {0, 0, 0, 0, 255, 255, 255};
+
+/*
+ * Consumer of an image produced top to bottom: begin once with the size,
+ * write_rows with consecutive bands of count rows of w * ch bytes, end once.
+ * destroy frees the sink.
+ */
+typedef struct row_sink_t
+{
+    bool (*begin)(struct row_sink_t *sink, int w, int h, int ch);
+    bool (*write_rows)(struct row_sink_t *sink, const uint8_t *rows, int count);
+    bool (*end)(struct row_sink_t *sink);
+    void (*destroy)(struct row_sink_t *sink);
+    void *state;
+} row_sink_t;
+
+// file formats of streamed output, chosen by extension
+typedef enum
+{
+    OUTPUT_JPEG,
+    OUTPUT_PNG, // uncompressed
+    OUTPUT_QOI,
+    OUTPUT_PPM, // PGM for 1 channel
+    OUTPUT_DZI, // deep zoom pyramid of jpeg tiles
+} output_format_t;
+
+// growable buffer of encoded bytes, owned by the caller (free data)
+typedef struct
+{
+    uint8_t *data;
+    size_t size, capacity;
+} memory_buffer_t;
+
+// destination of encoded bytes: a file at path, an open stream (left open) or memory
+typedef struct
+{
+    const char *path;
+    FILE *stream;
+    memory_buffer_t *memory;
+} output_target_t;
+
+// encoded bytes on their way to the target, written in large blocks
+typedef struct
+{
+    const char *name; // of the target, for messages
+    FILE *file;
+    bool close_file;
+    memory_buffer_t *memory; // buffer is its data if set
+    uint8_t *buffer;
+    size_t size, used;
+    bool failed;
+} byte_output_t;
+
+typedef struct
+{
+    int threads;     // 0 = all cpus
+    int tone_levels; // pre-toned copies of the tile, 0 = exact tone per cell
+    bool dither;     // ordered dithering between adjacent tone levels
+} single_options_t;
+
+static const single_options_t single_options_default = {0, 0, false};
+
+/* Distance kernels */
+
+static inline float shape_difference(const image_shape_t *s1, const image_shape_t *s2)
+{
+    return (fabsf(s1->y1 - s2->y1) + fabsf(s1->y2 - s2->y2) +
+            fabsf(s1->y3 - s2->y3) + fabsf(s1->y4 - s2->y4));
+}
+
+// shape_difference, stops after half the quadrants if already above limit
+static inline float shape_difference_below(const image_shape_t *s1, const image_shape_t *s2, float limit)
+{
+    float d = fabsf(s1->y1 - s2->y1) + fabsf(s1->y2 - s2->y2);
+    if (d > limit)
+        return d;
+    return d + fabsf(s1->y3 - s2->y3) + fabsf(s1->y4 - s2->y4);
+}
+
+/*
+ * Sum of the weighted CIELAB distances of the four quadrants.
+ */
+static inline float color_difference(const image_color_t *c1, const image_color_t *c2)
+{
+#ifdef __SSE2__
+    __m128 dl = _mm_sub_ps(_mm_loadu_ps(c1->l), _mm_loadu_ps(c2->l));
+    __m128 da = _mm_sub_ps(_mm_loadu_ps(c1->a), _mm_loadu_ps(c2->a));
+    __m128 db = _mm_sub_ps(_mm_loadu_ps(c1->b), _mm_loadu_ps(c2->b));
+
+    __m128 e = _mm_mul_ps(_mm_set1_ps(LAB_WEIGHT_L), _mm_mul_ps(dl, dl));
+    e = _mm_add_ps(e, _mm_mul_ps(_mm_set1_ps(LAB_WEIGHT_A), _mm_mul_ps(da, da)));
+    e = _mm_add_ps(e, _mm_mul_ps(_mm_set1_ps(LAB_WEIGHT_B), _mm_mul_ps(db, db)));
+    e = _mm_sqrt_ps(e);
+
+    // horizontal sum of the four quadrants
+    e = _mm_add_ps(e, _mm_movehl_ps(e, e));
+    e = _mm_add_ss(e, _mm_shuffle_ps(e, e, 1));
+    return _mm_cvtss_f32(e);
+#else
+    float d = 0;
+    for (int q = 0; q < 4; q++)
+    {
+        float dl = c1->l[q] - c2->l[q], da = c1->a[q] - c2->a[q], db = c1->b[q] - c2->b[q];
+        d += sqrtf(LAB_WEIGHT_L * dl * dl + LAB_WEIGHT_A * da * da + LAB_WEIGHT_B * db * db);
+    }
+    return d;
+#endif
+}
+
+static inline int get_descriptor_dimension(descriptor_t type)
+{
+    return type == DESCRIPTOR_COLOR ? 12 : 4;
+}
+
+static inline float get_descriptor_difference(descriptor_t type, const float *d1, const float *d2)
+{
+    if (type == DESCRIPTOR_COLOR)
+        return color_difference((const image_color_t *)d1, (const image_color_t *)d2);
+    return shape_difference((const image_shape_t *)d1, (const image_shape_t *)d2);
+}
+
+static inline bool is_excluded(const exclusion_t *exclusion, int image)
+{
+    return exclusion != NULL && exclusion->window_count[image] != 0;
+}
+
 /* Helper methods */
 
 void set_debug(bool debug);
@@ -65,8 +423,22 @@ image_shape_t get_image_shape(image_t image);
 float get_shape_difference(image_shape_t s1, image_shape_t s2);
 bool is_default_shape(image_shape_t s);
 
+void get_point_lab(uint8_t r, uint8_t g, uint8_t b, float *L, float *A, float *B);
+void get_image_descriptors(image_t image, float *luminance, image_shape_t *shape, image_color_t *color);
+float get_color_difference(image_color_t c1, image_color_t c2);
+bool is_default_color(image_color_t c);
+
 /* Image analysis */
 
+int get_auto_radius(int image_count, int rows, int cols);
+int get_exclusion_window_size(int radius);
+exclusion_t alloc_exclusion(int image_count, int radius, int ring, int rows, int cols);
+exclusion_t share_exclusion(const exclusion_t *exclusion, int image_count);
+void exclusion_move_to(exclusion_t *exclusion, int i, int j);
+void exclusion_place(exclusion_t *exclusion, int i, int j, int image);
+void exclusion_clear(exclusion_t *exclusion);
+void free_exclusion(exclusion_t *exclusion);
+
 bool check_image_dimensions(image_t image);
 void print_image_dimensions(char *name, image_t image);
 size_t get_image_size(image_t image);
@@ -74,9 +446,112 @@ size_t get_image_size(image_t image);
 int match_image_by_luminance(float Y, float *images_luminance, int count,
                              int not_allowed_1, int not_allowed_2);
 int match_image_by_shape(image_shape_t S, image_shape_t *images_structure, int count,
-                             int *not_allowed, int not_allowed_size);
-int match_any_image_above(float Y, float *images_luminance, int count,
-                          int *not_allowed, int not_allowed_size);
+                             const exclusion_t *exclusion);
+int match_image_by_color(image_color_t C, image_color_t *images_color, int count,
+                         const exclusion_t *exclusion);
+int match_any_image_above(float Y, const luminance_index_t *index,
+                          const exclusion_t *exclusion, const int *uses, int max_uses, unsigned int *seed);
+
+/* Tile indexes */
+
+int linear_nearest(descriptor_t type, const float *descriptors, int count, const float *descriptor,
+                   int k, int *ids, float *distances, const exclusion_t *exclusion);
+
+void build_kd_tree(kd_tree_t *tree, image_shape_t *images_structure, int count);
+int kd_tree_nearest(kd_tree_t *tree, image_shape_t S, int k, int *ids, float *distances,
+                    const exclusion_t *exclusion);
+void free_kd_tree(kd_tree_t *tree);
+
+void build_vp_tree(vp_tree_t *tree, descriptor_t type, const float *descriptors, int count);
+int vp_tree_nearest(vp_tree_t *tree, const float *descriptor, int k, int *ids, float *distances,
+                    const exclusion_t *exclusion);
+void free_vp_tree(vp_tree_t *tree);
+
+void build_batch_index(batch_index_t *index, descriptor_t type, const float *descriptors, int count);
+void batch_nearest(batch_index_t *index, const float *descriptors, candidate_list_t *candidates);
+void free_batch_index(batch_index_t *index);
+
+void build_shape_scan(shape_scan_t *scan, const image_shape_t *structure, int count);
+int shape_scan_nearest(const shape_scan_t *scan, image_shape_t S, const exclusion_t *exclusion);
+void free_shape_scan(shape_scan_t *scan);
+
+void build_luminance_index(luminance_index_t *index, const float *luminance, int count);
+int luminance_shortlist_nearest(const luminance_index_t *index, descriptor_t type, const float *descriptors,
+                                float Y, const float *descriptor, int shortlist,
+                                int k, int *ids, float *distances, const exclusion_t *exclusion);
+void free_luminance_index(luminance_index_t *index);
+
+void build_ivf_index(ivf_index_t *index, descriptor_t type, const float *descriptors, int count, int probes);
+int ivf_nearest(ivf_index_t *index, const float *descriptor, int k, int *ids, float *distances,
+                const exclusion_t *exclusion);
+void free_ivf_index(ivf_index_t *index);
+
+candidate_list_t alloc_candidate_list(int k, int count);
+void free_candidate_list(candidate_list_t *candidates);
+
+void build_tile_indexes(tile_library_t *library, multi_options_t options);
+void free_tile_indexes(tile_library_t *library);
+
+/* Match cache */
+
+void init_match_cache(match_cache_t *cache, descriptor_t type, int k);
+void get_match_cache_key(const match_cache_t *cache, const float *descriptor, int *key, float *centre);
+match_cache_entry_t *match_cache_find(match_cache_t *cache, const int *key);
+match_cache_entry_t *match_cache_insert(match_cache_t *cache, const int *key, const float *centre,
+                                        const int *ids, const float *distances, int count);
+void free_match_cache(match_cache_t *cache);
+
+/* Global assignment and refinement */
+
+int *assign_photos_global(candidate_list_t *candidates, int image_count, int max_uses,
+                          int rows, int cols, int radius, thread_pool_t *pool);
+long refine_placement(int *placement, int rows, int cols, const float *cell_descriptors,
+                      tile_library_t *library, multi_options_t *options,
+                      candidate_list_t *candidates, int *uses, double seconds,
+                      thread_pool_t *pool);
+
+/* Multi collage stages */
+
+cell_grid_t get_cell_grid(image_t creator, bool with_color);
+void free_cell_grid(cell_grid_t *cells);
+selection_grid_t select_photos(const cell_grid_t *cells, tile_library_t *library, multi_options_t options);
+void free_selection_grid(selection_grid_t *selection);
+image_t render_selection(const selection_grid_t *selection, tile_library_t *library, int channels, int threads);
+
+/* Streaming output */
+
+row_sink_t *create_image_sink(image_t *image);
+row_sink_t *create_jpeg_sink(output_target_t target, int quality, int threads);
+row_sink_t *create_dzi_sink(output_target_t target, int quality, int threads);
+row_sink_t *create_output_sink(output_target_t target, output_format_t format, int quality, int threads);
+row_sink_t *create_file_sink(const char *path, int quality, int threads);
+row_sink_t *create_memory_sink(memory_buffer_t *memory, output_format_t format, int quality, int threads);
+output_format_t get_output_format(const char *path);
+bool write_image_to_sink(image_t image, row_sink_t *sink);
+int get_jpeg_mcu_size(int quality);
+bool write_jpeg_mosaic(output_target_t target, int quality, int threads,
+                       const selection_grid_t *selection, const tile_library_t *library, int channels);
+void free_row_sink(row_sink_t *sink);
+
+bool open_byte_output(byte_output_t *output, output_target_t target);
+bool flush_byte_output(byte_output_t *output);
+bool close_byte_output(byte_output_t *output);
+void write_bytes(byte_output_t *output, const void *data, size_t size);
+
+static inline void put_byte(byte_output_t *output, uint8_t byte)
+{
+    if (output->used == output->size)
+        flush_byte_output(output);
+    output->buffer[output->used++] = byte;
+}
+
+bool stream_selection(const selection_grid_t *selection, tile_library_t *library, int channels,
+                      border_t border, int threads, row_sink_t *sink);
+bool stream_multiple_images(image_t creator, tile_library_t *library, multi_options_t options,
+                            border_t border, row_sink_t *sink);
+bool stream_single_image(image_t base, image_t paste, int mode, single_options_t options, row_sink_t *sink);
+bool assemble_multiple_images_jpeg(image_t creator, tile_library_t *library, multi_options_t options,
+                                   output_target_t target, int quality);
 
 /* Image manipulation */
 
@@ -85,14 +560,9 @@ image_t shrink_image_size(image_t image, int shrunk_width, int shrunk_height);
 
 bool paste_image_at_pos(image_t image_to, image_t image_from, int x, int y, float tone);
 
-image_t collage_from_single_image(image_t base, image_t paste, int mode);
-image_t collage_from_multiple_images(image_t creator,
-                                     uint8_t **image_array, int image_width, int image_height, int image_count,
-                                     float *images_luminance, image_shape_t *images_structure, bool mode_contour);
+image_t collage_from_single_image(image_t base, image_t paste, int mode, single_options_t options);
+image_t collage_from_multiple_images(image_t creator, tile_library_t *library, multi_options_t options);
 
 image_t get_contour_image(image_t image);
-image_t add_border(image_t image,
-                   int border_top, int border_bottom, int border_left, int border_right,
-                   int border_red, int border_green, int border_blue);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "thread-pool.h"
+
+int get_cpu_count()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
+static void run_tasks(thread_pool_t *pool)
+{
+    int task;
+    while ((task = __atomic_fetch_add(&pool->next_task, 1, __ATOMIC_RELAXED)) < pool->task_count)
+        pool->task(task, pool->arg);
+}
+
+static void *worker(void *arg)
+{
+    thread_pool_t *pool = arg;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true)
+    {
+        while (pool->generation == seen && !pool->stop)
+            pthread_cond_wait(&pool->job_ready, &pool->lock);
+        if (pool->stop)
+            break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_tasks(pool);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0)
+            pthread_cond_signal(&pool->job_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+thread_pool_t *thread_pool_create(int threads)
+{
+    if (threads <= 0)
+        threads = get_cpu_count();
+
+    thread_pool_t *pool = calloc(1, sizeof(thread_pool_t));
+    if (pool == NULL)
+        return NULL;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->job_ready, NULL);
+    pthread_cond_init(&pool->job_done, NULL);
+
+    pool->threads = malloc((threads - 1 > 0 ? threads - 1 : 1) * sizeof(pthread_t));
+    for (int t = 0; t < threads - 1; t++)
+    {
+        if (pthread_create(&pool->threads[t], NULL, worker, pool) != 0)
+            break;
+        pool->thread_count++;
+    }
+
+    return pool;
+}
+
+/*
+ * Runs task(0..task_count-1, arg) on all threads and returns when every
+ * task is finished.
+ */
+void thread_pool_run(thread_pool_t *pool, int task_count, thread_task_t task, void *arg)
+{
+    if (task_count <= 0)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->task_count = task_count;
+    pool->next_task = 0;
+    pool->active = pool->thread_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_tasks(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0)
+        pthread_cond_wait(&pool->job_done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void thread_pool_destroy(thread_pool_t *pool)
+{
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->job_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int t = 0; t < pool->thread_count; t++)
+        pthread_join(pool->threads[t], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->job_ready);
+    pthread_cond_destroy(&pool->job_done);
+    free(pool->threads);
+    free(pool);
+}
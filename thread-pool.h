@@ -0,0 +1,38 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ * Fixed set of worker threads that run the tasks 0..count-1 of a job.
+ * Tasks are handed out in ascending order, the calling thread helps.
+ */
+
+typedef void (*thread_task_t)(int task, void *arg);
+
+typedef struct
+{
+    pthread_t *threads;
+    int thread_count; // workers besides the calling thread
+
+    pthread_mutex_t lock;
+    pthread_cond_t job_ready, job_done;
+    unsigned long generation; // incremented for every job
+    int active;               // workers still busy with the job
+    bool stop;
+
+    thread_task_t task;
+    void *arg;
+    int task_count;
+    int next_task;
+} thread_pool_t;
+
+int get_cpu_count();
+
+// threads <= 0 uses all cpus, NULL on failure
+thread_pool_t *thread_pool_create(int threads);
+void thread_pool_run(thread_pool_t *pool, int task_count, thread_task_t task, void *arg);
+void thread_pool_destroy(thread_pool_t *pool);
+
+#endif